@@ -37,6 +37,8 @@ NACS_EXPORT() Config Config::loadYAML(const char *fname)
         conf.max_ttl_chn = max_ttl_chn_node.as<int>();
     if (auto listen_node = file["listen"])
         conf.listen = listen_node.as<std::string>();
+    if (auto publish_node = file["publish"])
+        conf.publish = publish_node.as<std::string>();
     if (auto runtime_dir_node = file["runtime_dir"])
         conf.runtime_dir = runtime_dir_node.as<std::string>();
 
@@ -50,6 +52,16 @@ NACS_EXPORT() Config Config::loadYAML(const char *fname)
         conf.dds_write_fuddl = (int8_t)t_node.as<int>();
     if (auto t_node = file["dds_write_fudhd"])
         conf.dds_write_fudhd = (int8_t)t_node.as<int>();
+    if (auto use_dma_node = file["use_dma"])
+        conf.use_dma = use_dma_node.as<bool>();
+    if (auto seq_store_size_node = file["seq_store_size"])
+        conf.seq_store_size = seq_store_size_node.as<size_t>();
+    if (auto max_queued_seqs_node = file["max_queued_seqs"])
+        conf.max_queued_seqs = max_queued_seqs_node.as<uint32_t>();
+    if (auto max_queued_bytes_node = file["max_queued_bytes"])
+        conf.max_queued_bytes = max_queued_bytes_node.as<size_t>();
+    if (auto arm_timeout_node = file["arm_timeout"])
+        conf.arm_timeout = arm_timeout_node.as<double>();
 
     return conf;
 }
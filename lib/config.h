@@ -34,12 +34,25 @@ struct Config {
     bool dummy = false;
     int max_ttl_chn = 31;
     std::string listen{"tcp://*:7777"};
+    // Address of the PUB socket for the state change notifications. Disabled if empty.
+    std::string publish{};
     std::string runtime_dir{"/var/lib/molecube/"};
     int8_t dds_write_adsu = -1;
     int8_t dds_write_wrlow = -1;
     int8_t dds_write_adhd = -1;
     int8_t dds_write_fuddl = -1;
     int8_t dds_write_fudhd = -1;
+    bool use_dma = false;
+    // Maximum total size of the sequences kept for `run_seq_by_hash`.
+    size_t seq_store_size = 64 * 1024 * 1024;
+    // Maximum number of queued sequences and the total memory used by them
+    // (the code and the decoded sequence).
+    // `0` for no limit.
+    uint32_t max_queued_seqs = 0;
+    size_t max_queued_bytes = 0;
+    // Cancel an armed sequence if it's not fired within this time (in seconds)
+    // after the FIFO is filled. `0` for no timeout.
+    double arm_timeout = 60;
 };
 
 }
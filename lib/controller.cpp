@@ -17,8 +17,10 @@
  *************************************************************************/
 
 #include "ctrl_iface.h"
+#include "dma_stream.h"
 #include "pulser.h"
 #include "dummy_pulser.h"
+#include "trace.h"
 
 #include <nacs-utils/container.h>
 #include <nacs-utils/log.h>
@@ -26,11 +28,12 @@
 #include <nacs-utils/streams.h>
 #include <nacs-utils/timer.h>
 
-#include <nacs-seq/zynq/bytecode.h>
-#include <nacs-seq/zynq/cmdlist.h>
+#include <nacs-seq/zynq/pulse_time.h>
 
 #include <chrono>
+#include <condition_variable>
 #include <iostream>
+#include <mutex>
 #include <thread>
 #include <tuple>
 
@@ -47,36 +50,69 @@ public:
     ~Controller();
 
 private:
+    // `Out` is where the pulses are sent to,
+    // either the pulser directly or a `DMAStream` of the pulser.
+    template<typename Out>
     class Runner;
+    using MMIORunner = Runner<Pulser>;
+    // The interface used by `PulseProgram::run` to drive a `Runner`.
+    // Specialized on whether any DDS override is active.
+    template<typename Out, bool has_ovr>
+    struct Emitter;
 
     bool concurrent_set(ReqOP op, uint32_t operand, bool is_override,
                         uint32_t val) override;
     bool concurrent_get(ReqOP op, uint32_t operand, bool is_override,
                         uint32_t &val) override;
     std::vector<int> get_active_dds() override;
+    uint32_t get_active_dds_mask() override;
     bool has_ttl_ovr() override;
+    void set_use_dma(bool use_dma) override;
+    void set_arm_timeout(uint64_t timeout_ns) override;
 
+    bool dds_ovr_active() const;
     bool check_dds(int chn);
+    bool has_pending_reset() const;
     void detect_dds(bool force=false);
     void dump_dds(int i);
     void set_dds_timing1(int adsu, int wrlow, int adhd, int fuddl, int fudhd) override;
 
-    // Process a command.
+    // Process a command. The pulses are sent to `out`, which is the output of `runner`
+    // when the command is run in the middle of a sequence.
     // Returns the sequence time forwarded and if the command needs a result.
-    template<bool checked>
-    std::pair<uint32_t,bool> run_cmd(const ReqCmd *cmd, Runner *runner=nullptr);
+    template<bool checked, typename Out>
+    std::pair<uint32_t,bool> run_cmd(const ReqCmd *cmd, Out &out, Runner<Out> *runner);
     // Check if we are waiting for results. If yes, try to get one.
     // Returns whether anything non-trivial is done, and whether a result was read.
     template<bool checked>
     std::pair<bool,bool> try_get_result();
     // Try to process a command or result.
     // Returns the sequence time forwarded and whether anything non-trivial is done.
-    template<bool checked>
-    std::pair<uint32_t,bool> process_reqcmd(Runner *runner=nullptr);
+    // With a DMA runner, this is called on the DMA thread while the worker waits
+    // for the lowering to finish.
+    template<bool checked, typename Out=Pulser>
+    std::pair<uint32_t,bool> process_reqcmd(Runner<Out> *runner=nullptr);
 
+    template<typename Out>
+    void run_code(Runner<Out> &runner, ReqSeq *seq);
+    // Send the sequence to the FPGA. For the MMIO mode, this returns after the
+    // end marker is sent without waiting for the sequence to finish
+    // so that the next sequence can be queued right behind it.
     void run_seq(ReqSeq *seq);
+    // Checks that are done after the sequences.
+    // Deferred until there's no more sequences queued in the MMIO mode.
+    void finish_seqs();
+    // Thrown by the runner when an armed sequence is cancelled.
+    struct ArmCancelled {};
+    void cancel_armed(ReqSeq *seq);
+    // Hand the sequence to the DMA thread and wait for the DMA to finish.
+    // Returns `false` if DMA isn't available.
+    bool run_seq_dma(ReqSeq *seq);
+    // Lower the sequence to the DMA ring. Runs on the DMA thread.
+    void lower_seq_dma(ReqSeq *seq);
 
     void worker();
+    void dma_worker();
 
     void sync_ttl()
     {
@@ -96,7 +132,16 @@ private:
     static constexpr uint8_t NDDS = 22;
 
     Pulser m_p;
+    // Whether the DDS memory can be read with the registers
+    // without going through the command FIFO.
+    const bool m_dds_read_reg;
+    // The DDS parameters (bit mask of channels) with set commands sent to the FIFO
+    // since the last time the FIFO was empty.
+    std::atomic<uint32_t> m_dds_set_pending[3] = {};
     DDSState m_dds_ovr[NDDS];
+    // Set when a DDS override is turned on.
+    // Used to interrupt a sequence emitted without override checks.
+    bool m_dds_ovr_added = false;
     uint32_t m_ttl[NUM_TTL_BANKS];
     uint16_t m_dds_phase[NDDS] = {0};
     // Reinitialize is a complicated sequence and is rarely needed
@@ -104,22 +149,62 @@ private:
     bool m_dds_pending_reset[NDDS] = {false};
     std::atomic<bool> m_dds_exist[NDDS] = {};
     uint64_t m_dds_check_time = 0;
-    ReqCmd *m_cmd_waiting = nullptr;
+    // The commands sent to the FPGA that are waiting for the results, in the order
+    // of the results. One slot in the result FIFO (31 results) is kept for the end marker.
+    static constexpr int max_cmds_waiting = 30;
+    ReqCmd *m_cmds_waiting[max_cmds_waiting];
+    int m_cmds_waiting_start = 0;
+    int m_ncmds_waiting = 0;
+    // The sequence waiting for the end marker (a loopback pulse) to be read back.
+    ReqSeq *m_seq_running = nullptr;
+    // Number of commands in `m_cmds_waiting` before the end marker.
+    // (i.e. the next result is the end marker if this is `0`).
+    int m_ncmds_before_marker = 0;
+    // Whether the end marker is for the last repetition of the sequence.
+    bool m_marker_last = false;
+    // Whether `finish_seqs` needs to be run.
+    bool m_seqs_pending = false;
+    // When the FPGA is expected to reach the end of the last sequence sent with MMIO.
+    uint64_t m_seq_end_t = 0;
+    // Set when a sequence finished with a timing failure. The error flag is sticky
+    // so it needs to be cleared before the sequences queued behind it finish.
+    bool m_clear_error = false;
+    // Sequences are not queued behind the previous one if the DDS's haven't been
+    // checked (in `finish_seqs`) for this long.
+    static constexpr uint64_t dds_check_interval = 10000000000ul; // 10s
+
+    std::atomic<bool> m_use_dma{false};
+    std::atomic<uint64_t> m_arm_timeout{0};
+    // Allocated on the first sequence that uses DMA
+    // together with the DMA thread that fills the ring.
+    std::unique_ptr<DMAStream<Pulser>> m_dma;
+    std::mutex m_dma_lock;
+    std::condition_variable m_dma_cond;
+    // The sequence being lowered by the DMA thread.
+    ReqSeq *m_dma_seq = nullptr;
+    bool m_dma_quit = false;
+    std::thread m_dma_worker;
 
     std::thread m_worker;
 };
 
 template<typename Pulser>
+template<typename Out>
 class Controller<Pulser>::Runner {
+    // The DMA stream is lowered on the DMA thread. For long sequences, it is paced
+    // by the real time in the same way as the MMIO mode so that the commands can
+    // be sent with the stream. Otherwise, it is only paced by the DMA ring.
+    static constexpr bool is_dma = !std::is_same<Out,Pulser>::value;
 public:
-    Runner(Controller &ctrl, const std::array<uint32_t,NUM_TTL_BANKS> &ttlmask,
-           uint64_t seq_len_ns)
+    Runner(Controller &ctrl, Out &out, ReqSeq *seq)
         : m_ctrl(ctrl),
-          m_ttlmask(ttlmask),
-          m_process_cmd(seq_len_ns > 1000000000ul) // 1s
+          m_out(out),
+          m_seq(seq),
+          m_ttlmask(seq->ttl_mask),
+          m_process_cmd(seq->seq_len_ns > 1000000000ul) // 1s
     {
         for (int bank = 0; bank < NUM_TTL_BANKS; bank++) {
-            m_preserve_ttl[bank] = (~ttlmask[bank]) & ctrl.m_ttl[bank];
+            m_preserve_ttl[bank] = (~m_ttlmask[bank]) & ctrl.m_ttl[bank];
         }
     }
     void ttl1(int full_chn, bool val, uint64_t t)
@@ -134,77 +219,93 @@ public:
         if (t <= 1000) {
             // 10us
             m_t += t;
-            m_ctrl.m_p.template ttl<true>(m_ctrl.m_ttl[bank], (uint32_t)t, bank);
+            m_out.template ttl<true>(m_ctrl.m_ttl[bank], (uint32_t)t, bank);
+            pulse_added();
         }
         else {
             m_t += 100;
-            m_ctrl.m_p.template ttl<true>(m_ctrl.m_ttl[bank], 100, bank);
+            m_out.template ttl<true>(m_ctrl.m_ttl[bank], 100, bank);
+            pulse_added();
             wait(t - 100);
         }
     }
+    template<bool has_ovr=true>
     void dds_freq(uint8_t chn, uint32_t freq)
     {
-        if (unlikely(m_ctrl.m_dds_ovr[chn].freq != uint32_t(-1))) {
+        if (has_ovr && unlikely(m_ctrl.m_dds_ovr[chn].freq != uint32_t(-1))) {
             wait(Seq::Zynq::PulseTime::DDSFreq);
             return;
         }
         m_t += Seq::Zynq::PulseTime::DDSFreq;
-        m_ctrl.m_p.template dds_set_freq<true>(chn, freq);
+        m_out.template dds_set_freq<true>(chn, freq);
+        pulse_added();
     }
+    template<bool has_ovr=true>
     void dds_amp(uint8_t chn, uint16_t amp)
     {
-        if (unlikely(m_ctrl.m_dds_ovr[chn].amp_enable)) {
+        if (has_ovr && unlikely(m_ctrl.m_dds_ovr[chn].amp_enable)) {
             wait(Seq::Zynq::PulseTime::DDSAmp);
             return;
         }
         m_t += Seq::Zynq::PulseTime::DDSAmp;
-        m_ctrl.m_p.template dds_set_amp<true>(chn, amp);
+        m_out.template dds_set_amp<true>(chn, amp);
+        pulse_added();
     }
+    template<bool has_ovr=true>
     void dds_phase(uint8_t chn, uint16_t phase)
     {
-        if (unlikely(m_ctrl.m_dds_ovr[chn].phase_enable)) {
+        if (has_ovr && unlikely(m_ctrl.m_dds_ovr[chn].phase_enable)) {
             wait(Seq::Zynq::PulseTime::DDSPhase);
             return;
         }
         m_ctrl.m_dds_phase[chn] = phase;
         m_t += Seq::Zynq::PulseTime::DDSPhase;
-        m_ctrl.m_p.template dds_set_phase<true>(chn, phase);
+        m_out.template dds_set_phase<true>(chn, phase);
+        pulse_added();
     }
+    template<bool has_ovr=true>
     void dds_detphase(uint8_t chn, uint16_t detphase)
     {
-        if (unlikely(m_ctrl.m_dds_ovr[chn].phase_enable)) {
+        if (has_ovr && unlikely(m_ctrl.m_dds_ovr[chn].phase_enable)) {
             wait(Seq::Zynq::PulseTime::DDSPhase);
             return;
         }
-        dds_phase(chn, uint16_t(m_ctrl.m_dds_phase[chn] + detphase));
+        dds_phase<has_ovr>(chn, uint16_t(m_ctrl.m_dds_phase[chn] + detphase));
     }
     void dac(uint8_t chn, uint16_t V)
     {
         m_t += Seq::Zynq::PulseTime::DAC;
-        m_ctrl.m_p.template dac<true>(chn, V);
+        m_out.template dac<true>(chn, V);
+        pulse_added();
     }
     template<bool checked=true>
     void clock(uint8_t period)
     {
         m_t += Seq::Zynq::PulseTime::Clock;
-        m_ctrl.m_p.template clock<checked>(period);
+        m_out.template clock<checked>(period);
+        pulse_added();
     }
     template<bool checked=true>
     void wait(uint64_t t)
     {
+        check_prefill();
         auto output_wait = [&] (uint64_t t) {
             m_t += t;
-            while (t > m_ctrl.m_p.max_wait_t + 100) {
-                t -= m_ctrl.m_p.max_wait_t;
-                m_ctrl.m_p.template wait<checked>(m_ctrl.m_p.max_wait_t);
+            while (t > m_out.max_wait_t + 100) {
+                t -= m_out.max_wait_t;
+                m_out.template wait<checked>(m_out.max_wait_t);
+                pulse_added();
             }
-            if (t > m_ctrl.m_p.max_wait_t) {
+            if (t > m_out.max_wait_t) {
                 auto t0 = t / 2;
-                m_ctrl.m_p.template wait<checked>(uint32_t(t0));
-                m_ctrl.m_p.template wait<checked>(uint32_t(t - t0));
+                m_out.template wait<checked>(uint32_t(t0));
+                pulse_added();
+                m_out.template wait<checked>(uint32_t(t - t0));
+                pulse_added();
             }
             else if (t > 0) {
-                m_ctrl.m_p.template wait<checked>(uint32_t(t));
+                m_out.template wait<checked>(uint32_t(t));
+                pulse_added();
             }
         };
         if (!m_process_cmd) {
@@ -215,7 +316,8 @@ public:
         if (t < 2000) {
             // If the wait time is too short, don't do anything fancy
             m_t += t;
-            m_ctrl.m_p.template wait<checked>(uint32_t(t));
+            m_out.template wait<checked>(uint32_t(t));
+            pulse_added();
             return;
         }
         while (true) {
@@ -237,6 +339,8 @@ public:
                 continue;
             }
             if (unlikely(!m_released)) {
+                // The wait below may reach the prefill limit and fire the sequence.
+                bool armed = m_arm_seq != nullptr;
                 m_released = true;
                 // At the beginning of the loop, `t` may come froms
                 // 1. The value before entering the loop, in which case `t >= 2000`.
@@ -247,18 +351,35 @@ public:
                 //    this branch again.
                 assert(t >= 2000);
                 m_t += 1000;
-                m_ctrl.m_p.template wait<checked>(uint32_t(1000));
+                m_out.template wait<checked>(uint32_t(1000));
+                pulse_added();
                 t -= 1000;
-                m_ctrl.m_p.release_hold();
+                // An armed sequence must not start before it's fired.
+                if (armed) {
+                    wait_fire();
+                }
+                else {
+                    release_hold();
+                }
             }
             // We have time to do something else
             uint32_t stept;
             bool processed;
-            std::tie(stept, processed) = m_ctrl.process_reqcmd<checked>(this);
+            std::tie(stept, processed) = m_ctrl.template process_reqcmd<checked>(this);
             if (!processed) {
-                // Didn't find much to do. Sleep for a while
-                using namespace std::literals;
-                std::this_thread::sleep_for(1ms);
+                // Didn't find much to do. Sleep until a new command arrives
+                // or until the sequence is no longer far enough ahead of the real time.
+                Trace::Scope trace(Trace::WaitSleep);
+                auto lead = int64_t(m_start_t + m_t * 10 - getCoarseTime());
+                if (lead > int64_t(m_min_t)) {
+                    if constexpr (is_dma) {
+                        if (!flush_dma<checked>(t)) {
+                            output_wait(t);
+                            return;
+                        }
+                    }
+                    m_ctrl.wait_cmd(lead - int64_t(m_min_t));
+                }
             }
             else {
                 m_t += stept;
@@ -268,7 +389,8 @@ public:
     }
     void wait_trigger(uint8_t chn, bool trig_raise, uint32_t timeout)
     {
-        m_ctrl.m_p.template wait_trigger<true>(chn, trig_raise, timeout);
+        m_out.template wait_trigger<true>(chn, trig_raise, timeout);
+        pulse_added();
         // Reset start time since the sequence will actually proceed when we
         // received a trigger from this command.
         m_t = 0;
@@ -278,28 +400,221 @@ public:
     {
         m_preserve_ttl[bank] = ttl & ~m_ttlmask[bank];
     }
+    bool dds_ovr_added() const
+    {
+        return m_ctrl.m_dds_ovr_added;
+    }
+    void release_hold()
+    {
+        m_ctrl.m_p.release_hold();
+        Trace::record(Trace::ReleaseHold, Trace::Instant);
+        set_released();
+    }
+    uint32_t npulses() const
+    {
+        return m_npulses;
+    }
+    // The real time (`getCoarseTime`) the FPGA is expected to reach
+    // the end of the pulses emitted so far.
+    // The sequence doesn't start before the hold is released.
+    uint64_t end_time() const
+    {
+        return max(m_start_t, m_release_t) + m_t * 10;
+    }
+    // For a sequence queued behind another one, which only starts
+    // when the FPGA reaches the end of the previous one.
+    void set_start_time(uint64_t t)
+    {
+        m_start_t = t;
+        m_release_t = t;
+    }
+    Out &out()
+    {
+        return m_out;
+    }
     void enable_process_cmd()
     {
         m_process_cmd = true;
     }
+    // Keep the hold after filling the FIFO with the beginning of the sequence
+    // until the sequence is fired.
+    void set_armed(ReqSeq *seq)
+    {
+        m_arm_seq = seq;
+    }
+    // Wait for the armed sequence to be fired and release the hold.
+    // Throws `ArmCancelled` if the sequence is cancelled, the backend is quitting
+    // or the arm timeout expires before that.
+    // The commands stay in the queue while waiting since anything sent to the FIFO now
+    // would only run after the part of the sequence that is already in there.
+    void wait_fire()
+    {
+        auto seq = m_arm_seq;
+        if (!seq)
+            return;
+        m_arm_seq = nullptr;
+        Trace::Scope trace(Trace::WaitFire, uint32_t(seq->id));
+        auto state = ArmInit;
+        if (seq->arm_state.compare_exchange_strong(state, ArmReady,
+                                                   std::memory_order_acq_rel)) {
+            auto timeout = m_ctrl.m_arm_timeout.load(std::memory_order_relaxed);
+            auto deadline = getCoarseTime() + timeout;
+            while (seq->arm_state.load(std::memory_order_acquire) != ArmFired) {
+                int64_t left = -1;
+                if (timeout) {
+                    auto tnow = getCoarseTime();
+                    left = tnow >= deadline ? 0 : int64_t(deadline - tnow);
+                }
+                if (left == 0 || seq->cancel.load(std::memory_order_relaxed) ||
+                    m_ctrl.quitting()) {
+                    state = ArmReady;
+                    // Fired at the same time. Too late to cancel.
+                    if (!seq->arm_state.compare_exchange_strong(
+                            state, ArmFired, std::memory_order_acq_rel))
+                        break;
+                    if (left == 0)
+                        Log::warn("Armed sequence %llu not fired in %.1f s, cancelled.\n",
+                                  (unsigned long long)seq->id, double(timeout) / 1e9);
+                    throw ArmCancelled();
+                }
+                m_ctrl.wait_armed(seq, left);
+            }
+        }
+        // The hold is only changed by this thread so that the read-modify-write
+        // of the register doesn't race with the preamble of the next sequence.
+        release_hold();
+        // The sequence starts now.
+        m_start_t = getCoarseTime();
+    }
 
 private:
+    // Called after every pulse so that the FIFO never overflows
+    // (and force releases the hold) while waiting for an armed sequence to be fired.
+    void pulse_added()
+    {
+        m_npulses++;
+        check_prefill();
+    }
+    // The FPGA can only fetch full blocks from the DMA stream. Fill the current block
+    // with part of the wait `t` and queue it before sleeping so that the FPGA has
+    // everything up to the current time. Returns `false` if `t` is too short for that.
+    template<bool checked>
+    bool flush_dma(uint64_t &t)
+    {
+        constexpr uint32_t mint = Seq::Zynq::PulseTime::Min;
+        auto npad = m_out.pulses_to_block_end();
+        if (t < uint64_t(npad) * mint + 3000)
+            return false;
+        for (uint32_t i = 0; i < npad; i++)
+            m_out.template wait<checked>(mint);
+        m_npulses += npad;
+        m_t += uint64_t(npad) * mint;
+        t -= uint64_t(npad) * mint;
+        m_out.flush();
+        return true;
+    }
+    void check_prefill()
+    {
+        if constexpr (!is_dma) {
+            if (unlikely(m_arm_seq) &&
+                (m_t >= max_prefill_t || m_npulses >= max_prefill_pulses)) {
+                wait_fire();
+            }
+        }
+    }
+    // Record the first time the hold is released.
+    void set_released()
+    {
+        m_released = true;
+        if (!m_release_t)
+            m_release_t = getCoarseTime();
+        if (!m_seq->times.release) {
+            m_seq->times.release = getTime();
+        }
+    }
+
     Controller &m_ctrl;
+    Out &m_out;
+    ReqSeq *const m_seq;
     const std::array<uint32_t,NUM_TTL_BANKS> m_ttlmask;
     std::array<uint32_t,NUM_TTL_BANKS> m_preserve_ttl;
     uint64_t m_t{0};
 
     uint64_t m_start_t{getCoarseTime()};
+    // The first time the hold is released.
+    uint64_t m_release_t{0};
     // Minimum time we stay ahead of the sequence.
     const uint64_t m_min_t{max(getCoarseRes() * 20, 500000000)}; // 0.5s
     bool m_process_cmd;
+    // The FIFO can hold 4096 pulses. Each pulse is at least `PulseTime::Min` long
+    // so we can always fit this much of the sequence in the FIFO.
+    static constexpr uint64_t max_prefill_t = 2048 * Seq::Zynq::PulseTime::Min;
+    // Leave some room in the FIFO for the pulses that don't go through the runner.
+    static constexpr uint32_t max_prefill_pulses = 4000;
+    ReqSeq *m_arm_seq = nullptr;
+
+    // The hold is released by the worker thread in the DMA mode.
+    bool m_released = is_dma;
+    uint32_t m_npulses = 0;
+};
 
-    bool m_released = false;
+template<typename Pulser>
+template<typename Out, bool has_ovr>
+struct Controller<Pulser>::Emitter {
+    Runner<Out> &runner;
+
+    void ttl1(int chn, bool val, uint64_t t)
+    {
+        runner.ttl1(chn, val, t);
+    }
+    void ttl(uint32_t ttl, uint64_t t, int bank)
+    {
+        runner.ttl(ttl, t, bank);
+    }
+    void dds_freq(uint8_t chn, uint32_t freq)
+    {
+        runner.template dds_freq<has_ovr>(chn, freq);
+    }
+    void dds_amp(uint8_t chn, uint16_t amp)
+    {
+        runner.template dds_amp<has_ovr>(chn, amp);
+    }
+    void dds_phase(uint8_t chn, uint16_t phase)
+    {
+        runner.template dds_phase<has_ovr>(chn, phase);
+    }
+    void dds_detphase(uint8_t chn, uint16_t detphase)
+    {
+        runner.template dds_detphase<has_ovr>(chn, detphase);
+    }
+    void dac(uint8_t chn, uint16_t V)
+    {
+        runner.dac(chn, V);
+    }
+    void clock(uint8_t period)
+    {
+        runner.clock(period);
+    }
+    void wait(uint64_t t)
+    {
+        runner.wait(t);
+    }
+    void wait_trigger(uint8_t chn, bool trig_raise, uint32_t timeout)
+    {
+        runner.wait_trigger(chn, trig_raise, timeout);
+    }
+    // Commands processed during a wait may turn on an override,
+    // in which case we need to switch to the version that checks it.
+    bool interrupted() const
+    {
+        return !has_ovr && runner.dds_ovr_added();
+    }
 };
 
 template<typename Pulser>
 Controller<Pulser>::Controller(Pulser &&p)
     : m_p(std::move(p)),
+      m_dds_read_reg(m_p.hw_version().check_at_least({5, 4})),
       m_worker(&Controller<Pulser>::worker, this)
 {
     for (int i = 0; i < NUM_TTL_BANKS; i++)
@@ -313,6 +628,14 @@ Controller<Pulser>::~Controller()
 {
     quit();
     m_worker.join();
+    if (m_dma_worker.joinable()) {
+        {
+            std::lock_guard<std::mutex> locker(m_dma_lock);
+            m_dma_quit = true;
+        }
+        m_dma_cond.notify_all();
+        m_dma_worker.join();
+    }
 }
 
 template<typename Pulser>
@@ -352,6 +675,36 @@ bool Controller<Pulser>::concurrent_get(ReqOP op, uint32_t operand, bool is_over
         val = m_p.cur_clock();
         return true;
     }
+    if (op == DDSFreq || op == DDSAmp || op == DDSPhase) {
+        // Overrides are handled by the cache in ctrl_iface.
+        // The DDS read registers are only used by the frontend thread.
+        if (is_override || !m_dds_read_reg ||
+            !m_dds_exist[operand].load(std::memory_order_relaxed))
+            return false;
+        // A set command may still be in the FIFO. Read the value with a command
+        // so that it's ordered after the set.
+        if ((m_dds_set_pending[op - DDSFreq].load(std::memory_order_relaxed) >> operand) & 1)
+            return false;
+        auto chn = uint8_t(operand);
+        if (op == DDSFreq) {
+            // The two halves are read separately, make sure the sequence didn't
+            // change the high half in between.
+            uint32_t hi = m_p.read_dds0(chn, 0x2e);
+            while (true) {
+                uint32_t lo = m_p.read_dds0(chn, 0x2c);
+                uint32_t hi2 = m_p.read_dds0(chn, 0x2e);
+                if (hi == hi2) {
+                    val = lo | (hi << 16);
+                    break;
+                }
+                hi = hi2;
+            }
+        }
+        else {
+            val = m_p.read_dds0(chn, op == DDSAmp ? 0x32 : 0x30);
+        }
+        return true;
+    }
     if (op != TTL)
         return false;
     auto type = operand & 3;
@@ -406,10 +759,21 @@ void Controller<Pulser>::set_dds_timing1(int adsu, int wrlow, int adhd,
                         (uint32_t)timings[3], (uint32_t)timings[4]);
 }
 
+template<typename Pulser>
+bool Controller<Pulser>::dds_ovr_active() const
+{
+    for (auto &ovr: m_dds_ovr) {
+        if (ovr.freq != uint32_t(-1) || ovr.amp_enable || ovr.phase_enable) {
+            return true;
+        }
+    }
+    return false;
+}
+
 template<typename Pulser>
 bool Controller<Pulser>::check_dds(int chn)
 {
-    assert(!m_cmd_waiting);
+    assert(!m_ncmds_waiting);
     if (m_dds_pending_reset[chn]) {
         auto &ovr = m_dds_ovr[chn];
         ovr.phase_enable = 0;
@@ -425,7 +789,7 @@ bool Controller<Pulser>::check_dds(int chn)
 template<typename Pulser>
 void Controller<Pulser>::dump_dds(int i)
 {
-    assert(!m_cmd_waiting);
+    assert(!m_ncmds_waiting);
     string_ostream stm;
     m_p.dump_dds(stm, i);
     auto str = stm.get_buf();
@@ -441,19 +805,22 @@ void Controller<Pulser>::dump_dds(int i)
     }
 }
 
+template<typename Pulser>
+bool Controller<Pulser>::has_pending_reset() const
+{
+    for (auto v: m_dds_pending_reset) {
+        if (v) {
+            return true;
+        }
+    }
+    return false;
+}
+
 template<typename Pulser>
 void Controller<Pulser>::detect_dds(bool force)
 {
-    assert(!m_cmd_waiting);
+    assert(!m_ncmds_waiting);
     const auto t = getCoarseTime();
-    auto has_pending_reset = [&] () {
-        for (auto v: m_dds_pending_reset) {
-            if (v) {
-                return true;
-            }
-        }
-        return false;
-    };
     if (!force && t < m_dds_check_time + 1000000000 && !has_pending_reset())
         return;
     for (int i = 0; i < NDDS; i++) {
@@ -486,6 +853,18 @@ std::vector<int> Controller<Pulser>::get_active_dds()
     return res;
 }
 
+template<typename Pulser>
+uint32_t Controller<Pulser>::get_active_dds_mask()
+{
+    uint32_t res = 0;
+    for (int i = 0; i < NDDS; i++) {
+        if (m_dds_exist[i].load(std::memory_order_relaxed)) {
+            res |= uint32_t(1) << i;
+        }
+    }
+    return res;
+}
+
 template<typename Pulser>
 bool Controller<Pulser>::has_ttl_ovr()
 {
@@ -498,9 +877,32 @@ bool Controller<Pulser>::has_ttl_ovr()
 }
 
 template<typename Pulser>
-template<bool checked>
-std::pair<uint32_t,bool> Controller<Pulser>::run_cmd(const ReqCmd *cmd, Runner *runner)
+void Controller<Pulser>::set_use_dma(bool use_dma)
+{
+    m_use_dma.store(use_dma, std::memory_order_relaxed);
+}
+
+template<typename Pulser>
+void Controller<Pulser>::set_arm_timeout(uint64_t timeout_ns)
 {
+    m_arm_timeout.store(timeout_ns, std::memory_order_relaxed);
+}
+
+template<typename Pulser>
+template<bool checked, typename Out>
+std::pair<uint32_t,bool> Controller<Pulser>::run_cmd(const ReqCmd *cmd, Out &out,
+                                                     Runner<Out> *runner)
+{
+    if (!cmd->has_res && (cmd->opcode == DDSFreq || cmd->opcode == DDSAmp ||
+                          cmd->opcode == DDSPhase)) {
+        m_dds_set_pending[cmd->opcode - DDSFreq].fetch_or(uint32_t(1) << cmd->operand,
+                                                          std::memory_order_relaxed);
+    }
+    else if (cmd->opcode == DDSReset) {
+        for (auto &pending: m_dds_set_pending) {
+            pending.fetch_or(uint32_t(1) << cmd->operand, std::memory_order_relaxed);
+        }
+    }
     switch (cmd->opcode) {
     case TTL: {
         // Should have been caught by concurrent_get/set.
@@ -515,7 +917,7 @@ std::pair<uint32_t,bool> Controller<Pulser>::run_cmd(const ReqCmd *cmd, Runner *
         }
         if (runner)
             runner->update_preserve_ttl(m_ttl[bank], bank);
-        m_p.template ttl<checked>(m_ttl[bank], Seq::Zynq::PulseTime::Min, bank);
+        out.template ttl<checked>(m_ttl[bank], Seq::Zynq::PulseTime::Min, bank);
         return {Seq::Zynq::PulseTime::Min, false};
     }
     case DDSFreq: {
@@ -538,15 +940,16 @@ std::pair<uint32_t,bool> Controller<Pulser>::run_cmd(const ReqCmd *cmd, Runner *
                 return {0, false};
             }
             else {
-                m_p.template dds_set_freq<checked>(chn, val);
+                m_dds_ovr_added = true;
+                out.template dds_set_freq<checked>(chn, val);
                 return {Seq::Zynq::PulseTime::DDSFreq, false};
             }
         }
         if (!has_res) {
-            m_p.template dds_set_freq<checked>(chn, val);
+            out.template dds_set_freq<checked>(chn, val);
             return {Seq::Zynq::PulseTime::DDSFreq, false};
         }
-        m_p.template dds_get_freq<checked>(chn);
+        out.template dds_get_freq<checked>(chn);
         return {Seq::Zynq::PulseTime::DDSFreq, true};
     }
     case DDSAmp: {
@@ -576,15 +979,16 @@ std::pair<uint32_t,bool> Controller<Pulser>::run_cmd(const ReqCmd *cmd, Runner *
             else {
                 ovr.amp = uint16_t(val16 & ((1 << 12) - 1));
                 ovr.amp_enable = true;
-                m_p.template dds_set_amp<checked>(chn, val16);
+                m_dds_ovr_added = true;
+                out.template dds_set_amp<checked>(chn, val16);
                 return {Seq::Zynq::PulseTime::DDSAmp, false};
             }
         }
         if (!has_res) {
-            m_p.template dds_set_amp<checked>(chn, val16);
+            out.template dds_set_amp<checked>(chn, val16);
             return {Seq::Zynq::PulseTime::DDSAmp, false};
         }
-        m_p.template dds_get_amp<checked>(chn);
+        out.template dds_get_amp<checked>(chn);
         return {Seq::Zynq::PulseTime::DDSAmp, true};
     }
     case DDSPhase: {
@@ -614,17 +1018,18 @@ std::pair<uint32_t,bool> Controller<Pulser>::run_cmd(const ReqCmd *cmd, Runner *
             else {
                 ovr.phase = val16;
                 ovr.phase_enable = true;
+                m_dds_ovr_added = true;
                 m_dds_phase[chn] = val16;
-                m_p.template dds_set_phase<checked>(chn, val16);
+                out.template dds_set_phase<checked>(chn, val16);
                 return {Seq::Zynq::PulseTime::DDSPhase, false};
             }
         }
         if (!has_res) {
             m_dds_phase[chn] = val16;
-            m_p.template dds_set_phase<checked>(chn, val16);
+            out.template dds_set_phase<checked>(chn, val16);
             return {Seq::Zynq::PulseTime::DDSPhase, false};
         }
-        m_p.template dds_get_phase<checked>(chn);
+        out.template dds_get_phase<checked>(chn);
         return {Seq::Zynq::PulseTime::DDSPhase, true};
     }
     case DDSReset: {
@@ -636,7 +1041,7 @@ std::pair<uint32_t,bool> Controller<Pulser>::run_cmd(const ReqCmd *cmd, Runner *
     }
     case Clock:
         assert(!cmd->is_override && !cmd->has_res && cmd->operand == 0);
-        m_p.template clock<checked>(uint8_t(cmd->val));
+        out.template clock<checked>(uint8_t(cmd->val));
         return {Seq::Zynq::PulseTime::Clock, false};
     default:
         return {0, false};
@@ -647,44 +1052,106 @@ template<typename Pulser>
 template<bool checked>
 std::pair<bool,bool> Controller<Pulser>::try_get_result()
 {
-    if (m_cmd_waiting) {
-        if (!m_p.try_get_result(m_cmd_waiting->val))
+    // The results come back in the same order as the pulses so we need to check
+    // whether the end marker or the command was sent first.
+    if (m_seq_running && m_ncmds_before_marker == 0) {
+        uint32_t marker;
+        if (!m_p.try_get_result(marker))
             return {true, false};
-        m_cmd_waiting = nullptr;
-        finish_cmd();
-        if (!checked) {
-            // The time is not very important, notify the frontend.
-            backend_event();
+        assert(marker == uint32_t(m_seq_running->id));
+        auto seq = m_seq_running;
+        m_seq_running = nullptr;
+        Trace::record(Trace::EndMarker, Trace::Instant, marker);
+        auto nfinished = seq->nfinished.load(std::memory_order_relaxed) + 1;
+        seq->nfinished.store(nfinished, std::memory_order_release);
+        if (m_marker_last) {
+            seq->times.end = getTime();
+            seq->times.timing_ok = m_p.timing_ok();
+            if (!seq->times.timing_ok) {
+                Log::warn("Timing failures.\n");
+                m_clear_error = true;
+            }
+            // Fewer repetitions means that the sequence was cancelled.
+            // The frontend may free the sequence after this.
+            seq->state.store(nfinished < seq->repeat ? SeqCancel : SeqEnd,
+                             std::memory_order_release);
         }
+        backend_event();
+        return {true, true};
+    }
+    if (m_ncmds_waiting) {
+        auto cmd = m_cmds_waiting[m_cmds_waiting_start];
+        if (!m_p.try_get_result(cmd->val))
+            return {true, false};
+        Trace::record(Trace::CmdResult, Trace::Instant, cmd->opcode);
+        m_cmds_waiting_start = (m_cmds_waiting_start + 1) % max_cmds_waiting;
+        m_ncmds_waiting--;
+        if (m_ncmds_before_marker)
+            m_ncmds_before_marker--;
+        // The frontend may free the command after this.
+        cmd->state.store(ReqCmd::Done, std::memory_order_release);
+        backend_event();
         return {true, true};
     }
     return {false, false};
 }
 
 template<typename Pulser>
-template<bool checked>
-std::pair<uint32_t,bool> Controller<Pulser>::process_reqcmd(Runner *runner)
+template<bool checked, typename Out>
+std::pair<uint32_t,bool> Controller<Pulser>::process_reqcmd(Runner<Out> *runner)
 {
     bool processed;
     bool res_read;
     std::tie(processed, res_read) = try_get_result<checked>();
+    if constexpr (std::is_same<Out,Pulser>::value) {
+        // The clear is a pulse so it's sent like a command and the runner
+        // accounts for its time. The end markers are only used with MMIO.
+        if (unlikely(m_clear_error)) {
+            m_clear_error = false;
+            m_p.clear_error();
+            return {Seq::Zynq::PulseTime::Clear, true};
+        }
+    }
     if (res_read)
         return {0, true};
-    // Already has a command waiting for result.
-    // We need to wait for it to finished before being able to process the next one.
-    if (m_cmd_waiting)
+    // The result FIFO may be full.
+    // We need to wait for some results before being able to process the next command.
+    if (m_ncmds_waiting >= max_cmds_waiting)
         return {0, true};
     if (auto cmd = get_cmd()) {
-        auto res = run_cmd<checked>(cmd, runner);
+        Trace::record(Trace::CmdRun, Trace::Instant, cmd->opcode);
+        std::pair<uint32_t,bool> res;
+        if constexpr (std::is_same<Out,Pulser>::value) {
+            res = run_cmd<checked>(cmd, m_p, runner);
+        }
+        else {
+            res = run_cmd<checked>(cmd, runner->out(), runner);
+        }
         if (res.second) {
-            m_cmd_waiting = cmd;
+            m_cmds_waiting[(m_cmds_waiting_start + m_ncmds_waiting) % max_cmds_waiting] = cmd;
+            m_ncmds_waiting++;
+            // The result is passed to the frontend with the command state.
+            finish_cmd();
         }
         else {
+            // `cmd` may be freed by the frontend after `finish_cmd`.
+            bool more = cmd->more;
             finish_cmd();
-            if (!checked) {
-                // The time is not very important, notify the frontend.
-                backend_event();
+            // Run the rest of the batch right away when we are not
+            // in the middle of a sequence.
+            while (more && !runner) {
+                // The frontend pushes the whole batch before notifying us
+                // but we might have started before it's done.
+                while (!(cmd = get_cmd()))
+                    std::this_thread::yield();
+                Trace::record(Trace::CmdRun, Trace::Instant, cmd->opcode);
+                more = cmd->more;
+                auto res2 = run_cmd<checked>(cmd, m_p, (MMIORunner*)nullptr);
+                assert(!res2.second);
+                res.first += res2.first;
+                finish_cmd();
             }
+            backend_event();
         }
         return {res.first, true};
     }
@@ -692,58 +1159,243 @@ std::pair<uint32_t,bool> Controller<Pulser>::process_reqcmd(Runner *runner)
 }
 
 template<typename Pulser>
-void Controller<Pulser>::run_seq(ReqSeq *seq)
+template<typename Out>
+void Controller<Pulser>::run_code(Runner<Out> &runner, ReqSeq *seq)
 {
-    // Read all the result (`toggle_init` may abort it).
+    auto &program = seq->program;
+    size_t start = 0;
+    if (!dds_ovr_active()) {
+        // Emit without checking the override for every DDS pulse
+        // until an override is turned on in the middle of the sequence.
+        m_dds_ovr_added = false;
+        start = program.run(Emitter<Out,false>{runner});
+        if (start >= program.insts().size()) {
+            return;
+        }
+    }
+    program.run(Emitter<Out,true>{runner}, start);
+}
+
+template<typename Pulser>
+void Controller<Pulser>::lower_seq_dma(ReqSeq *seq)
+{
+    m_dma->reset();
+    Runner<DMAStream<Pulser>> runner(*this, *m_dma, seq);
+    // Give the DMA engine a head start before the first timed pulse.
+    runner.template wait<false>(1000);
+    run_code(runner, seq);
+    // Stop the timing check with a short wait.
+    runner.template wait<false>(Seq::Zynq::PulseTime::Min);
+    if (!seq->is_cmd) {
+        // This is a hack that is believed to make the NI card happy.
+        runner.template clock<false>(9);
+    }
+    m_dma->finish();
+    seq->times.npulses = runner.npulses();
+}
+
+template<typename Pulser>
+void Controller<Pulser>::dma_worker()
+{
+    Trace::init_thread("dma");
+    std::unique_lock<std::mutex> locker(m_dma_lock);
     while (true) {
-        auto res = try_get_result<false>();
-        if (!res.first)
-            break;
-        if (unlikely(!res.second)) {
-            std::this_thread::yield();
+        m_dma_cond.wait(locker, [&] { return m_dma_seq || m_dma_quit; });
+        if (m_dma_quit)
+            return;
+        auto seq = m_dma_seq;
+        locker.unlock();
+        {
+            Trace::Scope trace(Trace::DMALower, uint32_t(seq->id));
+            lower_seq_dma(seq);
+        }
+        locker.lock();
+        m_dma_seq = nullptr;
+        m_dma_cond.notify_all();
+    }
+}
+
+template<typename Pulser>
+bool Controller<Pulser>::run_seq_dma(ReqSeq *seq)
+{
+    if (!m_dma) {
+        m_dma.reset(new DMAStream<Pulser>(m_p));
+        if (!m_dma->init()) {
+            Log::warn("Failed to allocate DMA buffer, DMA disabled.\n");
+            m_use_dma.store(false, std::memory_order_relaxed);
+            m_dma.reset();
+            return false;
         }
+        m_dma_worker = std::thread(&Controller<Pulser>::dma_worker, this);
     }
-    // Make sure all commands are finished (`toggle_init` will clear them)
-    while (unlikely(!m_p.is_finished()))
+    for (int bank = 0; bank < NUM_TTL_BANKS; bank++)
+        m_p.set_dma_ttl_mask(bank, seq->ttl_mask[bank]);
+    auto underruns = m_dma->underruns();
+    auto lowering = [&] {
+        std::lock_guard<std::mutex> locker(m_dma_lock);
+        return m_dma_seq != nullptr;
+    };
+    {
+        std::lock_guard<std::mutex> locker(m_dma_lock);
+        m_dma_seq = seq;
+    }
+    m_dma_cond.notify_all();
+    // Release the hold once the first block is in the FIFO.
+    // The DMA thread may still be lowering the rest of the sequence,
+    // the ring keeps it at most a few buffers ahead of the FPGA.
+    while (!m_dma->blocks_queued() && lowering())
         std::this_thread::yield();
-    sync_ttl();
-    m_p.set_hold();
-    // `toggle_init` is needed to clear the force release flag
-    // so that `set_hold` can work.
-    m_p.toggle_init();
-    seq->state.store(SeqStart, std::memory_order_relaxed);
+    while (m_p.dma_busy() && !m_p.dma_blocks_done())
+        std::this_thread::yield();
+    m_p.release_hold();
+    Trace::record(Trace::ReleaseHold, Trace::Instant);
+    seq->times.release = getTime();
+    m_dma->set_started();
+    {
+        std::unique_lock<std::mutex> locker(m_dma_lock);
+        m_dma_cond.wait(locker, [&] { return m_dma_seq == nullptr; });
+    }
+    seq->times.flush = getTime();
+    Trace::record(Trace::Flush, Trace::Instant, uint32_t(seq->id));
+    seq->state.store(SeqFlushed, std::memory_order_release);
     backend_event();
-
-    Runner runner(*this, seq->ttl_mask, seq->seq_len_ns);
-    try {
-        auto ver = seq->ver;
-        assert(ver == 1 || ver == 2 || ver == 3);
-        if (unlikely(seq->is_cmd)) {
-            Seq::Zynq::CmdList::ExeState exestate;
-            if (ver > 1)
-                exestate.min_time = Seq::Zynq::PulseTime::Min2;
-            exestate.run(runner, seq->code, seq->code_len, ver);
+    if (m_dma->underruns() != underruns)
+        Log::warn("DMA underrun: %llu (total %llu).\n",
+                  (unsigned long long)(m_dma->underruns() - underruns),
+                  (unsigned long long)m_dma->underruns());
+    // The commands that arrive during the lowering of a long sequence are sent
+    // with the stream by the DMA thread. The new ones cannot be ordered with the pulses
+    // still in the DMA buffer so they have to wait until the DMA finishes,
+    // which is within about 0.5s for those sequences. Keep reading the results
+    // in the meantime.
+    while (m_p.dma_busy()) {
+        if (!try_get_result<false>().second) {
+            using namespace std::literals;
+            std::this_thread::sleep_for(100us);
         }
-        else {
-            Seq::Zynq::ByteCode::ExeState exestate;
-            if (ver > 1)
-                exestate.min_time = Seq::Zynq::PulseTime::Min2;
-            exestate.run(runner, seq->code, seq->code_len, ver);
+    }
+    return true;
+}
+
+template<typename Pulser>
+void Controller<Pulser>::run_seq(ReqSeq *seq)
+{
+    Trace::Scope trace(Trace::RunSeq, uint32_t(seq->id));
+    seq->times.start = getTime();
+    bool use_dma = m_use_dma.load(std::memory_order_relaxed);
+    // If the previous sequence is still running, queue this one right behind it.
+    // The hold and the TTL sync are skipped since they need the FPGA to be idle.
+    // The DMA can only be started when the FPGA is idle so it is never pipelined.
+    // Armed and repeated sequences need the FIFO to itself and are sent with MMIO.
+    if (seq->armed || seq->repeat > 1)
+        use_dma = false;
+    // Also go through the preamble from time to time during a long run of
+    // back-to-back sequences so that the DDS's are still checked.
+    bool pipelined = (m_seq_running && !use_dma && !seq->armed && !has_pending_reset() &&
+                      getCoarseTime() < m_dds_check_time + dds_check_interval);
+    if (!pipelined) {
+        Trace::Scope trace(Trace::Preamble);
+        // Read all the result (`toggle_init` may abort it).
+        // This includes the end marker of the previous sequence.
+        while (true) {
+            auto res = try_get_result<false>();
+            if (!res.first)
+                break;
+            if (unlikely(!res.second)) {
+                std::this_thread::yield();
+            }
         }
+        // Make sure all commands are finished (`toggle_init` will clear them)
+        while (unlikely(!m_p.is_finished()))
+            std::this_thread::yield();
+        if (m_seqs_pending)
+            finish_seqs();
+        sync_ttl();
+        m_p.set_hold();
+        // `toggle_init` is needed to clear the force release flag
+        // so that `set_hold` can work.
+        m_p.toggle_init();
     }
-    catch (const std::exception &err) {
-        Log::error("Error while running sequence: %s.\n", err.what());
+    seq->times.emit = getTime();
+    MMIORunner runner(*this, m_p, seq);
+    if (pipelined) {
+        // There's no hold when the sequence is queued behind the previous one.
+        // It starts when the FPGA reaches the end of the previous sequence.
+        auto start_t = max(m_seq_end_t, getCoarseTime());
+        runner.set_start_time(start_t);
+        seq->times.release = start_t;
     }
-    // Stop the timing check with a short wait.
-    // Do this before releasing the hold since the effect of the time check flag
-    // in the previous instruction last until the next one.
-    runner.template wait<false>(Seq::Zynq::PulseTime::Min);
-    m_p.release_hold();
-    seq->state.store(SeqFlushed, std::memory_order_relaxed);
+    seq->state.store(SeqStart, std::memory_order_release);
     backend_event();
-    if (!seq->is_cmd) {
-        // This is a hack that is believed to make the NI card happy.
-        runner.template clock<false>(9);
+
+    if (!use_dma || !run_seq_dma(seq)) {
+        for (uint32_t i = 0; ; i++) {
+            Trace::record(Trace::Repeat, Trace::Instant, i);
+            if (i == 0 && seq->armed) {
+                uint16_t dds_phase[NDDS];
+                memcpy(dds_phase, m_dds_phase, sizeof(dds_phase));
+                runner.set_armed(seq);
+                try {
+                    run_code(runner, seq);
+                    // The sequence fits in the FIFO
+                    runner.wait_fire();
+                }
+                catch (const ArmCancelled&) {
+                    memcpy(m_dds_phase, dds_phase, sizeof(dds_phase));
+                    cancel_armed(seq);
+                    return;
+                }
+            }
+            else {
+                run_code(runner, seq);
+            }
+            // Stop the timing check with a short wait.
+            // Do this before releasing the hold since the effect of the time check flag
+            // in the previous instruction last until the next one.
+            runner.template wait<false>(Seq::Zynq::PulseTime::Min);
+            bool last = i + 1 >= seq->repeat || seq->cancel.load(std::memory_order_relaxed);
+            if (i == 0)
+                runner.release_hold();
+            if (last) {
+                seq->times.flush = getTime();
+                Trace::record(Trace::Flush, Trace::Instant, uint32_t(seq->id));
+                seq->state.store(SeqFlushed, std::memory_order_release);
+                backend_event();
+            }
+            if (!seq->is_cmd) {
+                // This is a hack that is believed to make the NI card happy.
+                runner.template clock<false>(9);
+            }
+            // Only keep track of one end marker at a time.
+            while (m_seq_running) {
+                if (!process_reqcmd<false>(&runner).second) {
+                    std::this_thread::yield();
+                }
+            }
+            // The repetition is finished when the FPGA reaches the marker,
+            // which is detected in `try_get_result`.
+            m_seq_running = seq;
+            m_ncmds_before_marker = m_ncmds_waiting;
+            m_marker_last = last;
+            // The sequence may be freed once the marker is read back.
+            seq->times.npulses = runner.npulses();
+            m_p.template loopback<false>(uint32_t(seq->id));
+            runner.enable_process_cmd();
+            if (!seq->is_cmd) {
+                // 10ms
+                runner.template wait<false>(1000000);
+                runner.template clock<false>(255);
+            }
+            if (last) {
+                m_seq_end_t = runner.end_time();
+                break;
+            }
+            if (seq->delay_ns >= 10) {
+                runner.template wait<false>(seq->delay_ns / 10);
+            }
+        }
+        m_seqs_pending = true;
+        return;
     }
     // Wait for the sequence to finish.
     while (!m_p.is_finished()) {
@@ -751,7 +1403,9 @@ void Controller<Pulser>::run_seq(ReqSeq *seq)
             std::this_thread::yield();
         }
     }
-    seq->state.store(SeqEnd, std::memory_order_relaxed);
+    seq->times.end = getTime();
+    seq->times.timing_ok = m_p.timing_ok();
+    seq->state.store(SeqEnd, std::memory_order_release);
     backend_event();
     runner.enable_process_cmd();
     if (!seq->is_cmd) {
@@ -759,11 +1413,31 @@ void Controller<Pulser>::run_seq(ReqSeq *seq)
         runner.template wait<false>(1000000);
         runner.template clock<false>(255);
     }
+    finish_seqs();
+}
+
+template<typename Pulser>
+void Controller<Pulser>::cancel_armed(ReqSeq *seq)
+{
+    // Nothing in the sequence has run yet, throw away the FIFO and
+    // restore the TTL state from the hardware.
+    m_p.toggle_init();
+    m_p.release_hold();
+    sync_ttl();
+    seq->state.store(SeqCancel, std::memory_order_release);
+    backend_event();
+}
+
+template<typename Pulser>
+void Controller<Pulser>::finish_seqs()
+{
+    m_seqs_pending = false;
     if (!m_p.timing_ok())
         Log::warn("Timing failures.\n");
     m_p.clear_error();
+    m_clear_error = false;
 
-    if (!m_cmd_waiting) {
+    if (!m_ncmds_waiting) {
         // Doing this check before this sequence will make the current sequence
         // more likely to work. However, that increase the latency and the DDS
         // reset only happen very infrequently so let's do it after the sequence
@@ -774,29 +1448,55 @@ void Controller<Pulser>::run_seq(ReqSeq *seq)
                 dump_dds(i);
             }
         }
+        m_dds_check_time = getCoarseTime();
     }
 }
 
 template<typename Pulser>
 void Controller<Pulser>::worker()
 {
-    while (wait(500000000)) { // Wake up every 500ms
+    Trace::init_thread("worker");
+    // Wake up every 500ms, or poll for the end of the sequence
+    // or the command results without sleeping.
+    while (wait(m_seq_running || m_ncmds_waiting ? 0 : 500000000)) {
         if (auto seq = get_seq()) {
             if (seq->cancel.load(std::memory_order_relaxed)) {
-                seq->state.store(SeqCancel, std::memory_order_relaxed);
+                seq->state.store(SeqCancel, std::memory_order_release);
             }
             else {
                 run_seq(seq);
             }
+            // The sequence may still be running at this point.
+            // The frontend won't free it before it reaches `SeqEnd`.
             finish_seq();
+            continue;
+        }
+        if (m_seq_running) {
+            if (!process_reqcmd<false>().second)
+                std::this_thread::yield();
+            continue;
         }
-        if (m_p.is_finished())
+        if (m_seqs_pending && !m_ncmds_waiting)
+            finish_seqs();
+        if (m_p.is_finished()) {
             sync_ttl();
-        if (!m_cmd_waiting) {
+            // A reset is only sent to the DDS by `check_dds`,
+            // keep the channel marked as pending until that's done.
+            uint32_t reset_pending = 0;
+            for (int i = 0; i < NDDS; i++) {
+                if (m_dds_pending_reset[i]) {
+                    reset_pending |= uint32_t(1) << i;
+                }
+            }
+            for (auto &pending: m_dds_set_pending) {
+                pending.fetch_and(reset_pending, std::memory_order_relaxed);
+            }
+        }
+        if (!m_ncmds_waiting) {
             detect_dds();
         }
         process_reqcmd<false>();
-        if (!m_cmd_waiting) {
+        if (!m_ncmds_waiting) {
             detect_dds();
         }
     }
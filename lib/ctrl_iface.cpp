@@ -19,70 +19,83 @@
 #include "ctrl_iface.h"
 
 #include <nacs-utils/fd_utils.h>
+#include <nacs-utils/log.h>
 #include <nacs-utils/timer.h>
 
-#include <chrono>
+#include <thread>
 
 namespace Molecube {
 
 void CtrlIFace::CmdCache::set(ReqOP op, uint32_t operand, bool is_override, uint32_t val)
 {
-    auto t = getTime();
-    auto update_entry = [&] (auto &entry) {
-        entry.t = t;
-        entry.val = val;
-        for (auto &cb: entry.cbs)
-            cb(val);
-        entry.cbs.clear();
-    };
-    auto key = cache_key(op, operand, is_override);
-    auto &entry = m_cache[key];
-    update_entry(entry);
+    bool is_dds = op == DDSFreq || op == DDSAmp || op == DDSPhase;
+    if (is_override) {
+        assert(is_dds);
+        auto typ = op - DDSFreq;
+        if (val == uint32_t(-1)) {
+            m_dds_ovrs.mask[typ] &= ~(uint32_t(1) << operand);
+        }
+        else {
+            m_dds_ovrs.mask[typ] |= uint32_t(1) << operand;
+            m_dds_ovrs.val[typ][operand] = val;
+        }
+        return;
+    }
+    auto idx = cache_idx(op, operand);
+    auto &entry = m_cache[idx];
+    entry.t = getTime();
+    entry.val = val;
     // If this is a normal set command for DDS, we need to update the override value as well.
-    if (!is_override && (op == DDSFreq || op == DDSAmp || op == DDSPhase)) {
-        key = cache_key(op, operand, true);
-        auto it = m_cache.find(key);
-        if (it != m_cache.end() && it->second.val != uint32_t(-1)) {
-            update_entry(it->second);
+    if (is_dds) {
+        auto typ = op - DDSFreq;
+        if ((m_dds_ovrs.mask[typ] >> operand) & 1) {
+            m_dds_ovrs.val[typ][operand] = val;
         }
     }
+    if (!entry.cb)
+        return;
+    // Take the callbacks out of the entry before calling them
+    // so that a callback querying the same value again can add a new one.
+    auto cb = std::move(entry.cb);
+    auto cbs = std::move(m_overflow[idx]);
+    cb(val);
+    if (!cbs)
+        return;
+    for (auto &cb: *cbs)
+        cb(val);
+    cbs->clear();
+    // Keep the vector for reuse.
+    if (!m_overflow[idx]) {
+        m_overflow[idx] = std::move(cbs);
+    }
 }
 
 bool CtrlIFace::CmdCache::get(ReqOP op, uint32_t operand, bool is_override, callback_t cb)
 {
-    auto key = cache_key(op, operand, is_override);
+    // DDS overrides are only kept in software so no need to ask the backend.
+    if (is_override) {
+        auto typ = op - DDSFreq;
+        cb(((m_dds_ovrs.mask[typ] >> operand) & 1) ? m_dds_ovrs.val[typ][operand] :
+           uint32_t(-1));
+        return true;
+    }
     auto t = getTime();
-    auto &entry = m_cache[key];
+    auto idx = cache_idx(op, operand);
+    auto &entry = m_cache[idx];
     if (t - entry.t <= 100000000) {
         // < 0.1s
         cb(entry.val);
         return true;
     }
-    // DDS overrides are only kept in software so no need to ask the backend.
-    if (is_override) {
-        // Initially off (-1) by default.
-        if (entry.t == 0)
-            entry.val = -1;
-        cb(entry.val);
-        return true;
-    }
-    auto was_empty = entry.cbs.empty();
-    entry.cbs.push_back(std::move(cb));
-    return !was_empty;
-}
-
-inline bool CtrlIFace::CmdCache::has_dds_ovr()
-{
-    for (int i = 0; i < 22; i++) {
-        for (auto op: (ReqOP[]){DDSFreq, DDSAmp, DDSPhase}) {
-            auto key = cache_key(op, i, true);
-            auto it = m_cache.find(key);
-            if (it == m_cache.end() || it->second.val == uint32_t(-1))
-                continue;
-            return true;
-        }
+    if (!entry.cb) {
+        entry.cb = std::move(cb);
+        return false;
     }
-    return false;
+    auto &cbs = m_overflow[idx];
+    if (!cbs)
+        cbs.reset(new std::vector<callback_t>);
+    cbs->push_back(std::move(cb));
+    return true;
 }
 
 CtrlIFace::CtrlIFace()
@@ -92,17 +105,25 @@ CtrlIFace::CtrlIFace()
 
 bool CtrlIFace::wait(int64_t maxt)
 {
-    std::unique_lock<std::mutex> lk(m_ftend_lck);
-    auto pred = [&] {
-        return m_quit || m_seq_queue.get_filter() || m_cmd_queue.get_filter();
-    };
-    if (maxt < 0) {
-        m_ftend_evt.wait(lk, pred);
-    }
-    else {
-        m_ftend_evt.wait_for(lk, std::chrono::nanoseconds(maxt), pred);
-    }
-    return !m_quit;
+    m_ftend_bell.wait([&] {
+        return (m_quit.load(std::memory_order_relaxed) || m_seq_queue.get_filter() ||
+                m_cmd_queue.get_filter());
+    }, maxt);
+    return !m_quit.load(std::memory_order_relaxed);
+}
+
+bool CtrlIFace::wait_cmd(int64_t maxt)
+{
+    return m_ftend_bell.wait([&] { return m_cmd_queue.get_filter() != nullptr; }, maxt);
+}
+
+bool CtrlIFace::wait_armed(ReqSeq *seq, int64_t maxt)
+{
+    return m_ftend_bell.wait([&] {
+        return (seq->arm_state.load(std::memory_order_acquire) == ArmFired ||
+                seq->cancel.load(std::memory_order_relaxed) ||
+                m_quit.load(std::memory_order_relaxed));
+    }, maxt);
 }
 
 auto CtrlIFace::get_seq() -> ReqSeq*
@@ -118,7 +139,20 @@ void CtrlIFace::finish_seq()
 
 auto CtrlIFace::get_cmd() -> ReqCmd*
 {
-    return m_cmd_queue.get_filter();
+    auto cmd = m_cmd_queue.get_filter();
+    if (!cmd)
+        return nullptr;
+    // Stop the frontend from changing the command.
+    uint8_t state = ReqCmd::Queued;
+    while (!cmd->state.compare_exchange_weak(state, ReqCmd::Taken, std::memory_order_acquire,
+                                             std::memory_order_relaxed)) {
+        if (state == ReqCmd::Taken)
+            break;
+        if (state == ReqCmd::Updating)
+            std::this_thread::yield();
+        state = ReqCmd::Queued;
+    }
+    return cmd;
 }
 
 void CtrlIFace::finish_cmd()
@@ -126,9 +160,29 @@ void CtrlIFace::finish_cmd()
     m_cmd_queue.forward_filter();
 }
 
-NACS_EXPORT() uint64_t CtrlIFace::_run_code(bool is_cmd, uint32_t ver, uint64_t seq_len_ns,
+NACS_EXPORT() PulseProgram CtrlIFace::decode_code(bool is_cmd, uint32_t ver,
+                                                  const uint8_t *code, size_t code_len)
+{
+    // Decode the sequence before queuing it so that the controller thread only need to
+    // stream the decoded operations.
+    PulseProgram program;
+    try {
+        assert(ver == 1 || ver == 2 || ver == 3);
+        program.decode(is_cmd, ver, code, code_len);
+    }
+    catch (const std::exception &err) {
+        // Run the part before the error, same as when the sequence was decoded
+        // while running.
+        Log::error("Error while decoding sequence: %s.\n", err.what());
+    }
+    return program;
+}
+
+NACS_EXPORT() uint64_t CtrlIFace::_run_code(const SeqOpts &opts, bool is_cmd, uint32_t ver,
+                                            uint64_t seq_len_ns,
                                             const std::array<uint32_t,NUM_TTL_BANKS> &ttl_mask,
                                             const uint8_t *code, size_t code_len,
+                                            PulseProgram &&program,
                                             std::unique_ptr<ReqSeqNotify> notify,
                                             AnyPtr storage)
 {
@@ -136,12 +190,14 @@ NACS_EXPORT() uint64_t CtrlIFace::_run_code(bool is_cmd, uint32_t ver, uint64_t
     auto id = ++m_seq_cnt;
     notify->set_id(id);
     auto seq = m_seq_alloc.alloc(id, seq_len_ns, code, code_len, ttl_mask, ver, is_cmd,
-                                 std::move(notify), std::move(storage));
-    {
-        std::lock_guard<std::mutex> lk(m_ftend_lck);
-        m_seq_queue.push(seq);
-    }
-    m_ftend_evt.notify_all();
+                                 opts, std::move(program), std::move(notify),
+                                 std::move(storage));
+    seq->times.queued = getTime();
+    // Only written by the frontend thread.
+    m_nseqs_queued.store(queued_seqs() + 1, std::memory_order_relaxed);
+    m_seq_bytes_queued.store(queued_seq_bytes() + seq->mem_size, std::memory_order_relaxed);
+    m_seq_queue.push(seq);
+    m_ftend_bell.ring();
     return id;
 }
 
@@ -154,30 +210,76 @@ NACS_EXPORT() bool CtrlIFace::cancel_seq(uint64_t id)
             seq->cancel.store(true, std::memory_order_relaxed);
         }
     }
+    // Wake up the backend if it's waiting for an armed sequence to be fired.
+    if (found)
+        m_ftend_bell.ring();
     return found;
 }
 
+NACS_EXPORT() bool CtrlIFace::fire_seq(uint64_t id)
+{
+    for (auto seq: m_seq_queue) {
+        if (seq->id != id)
+            continue;
+        if (!seq->armed)
+            return false;
+        auto state = seq->arm_state.exchange(ArmFired, std::memory_order_acq_rel);
+        // The backend releases the hold when it sees the new state.
+        // If it's still filling the FIFO, it'll start the sequence as soon as it's done.
+        if (state == ArmReady)
+            m_ftend_bell.ring();
+        return state != ArmFired;
+    }
+    return false;
+}
+
 void CtrlIFace::backend_event()
 {
-    writeEvent(m_bkend_evt);
+    // Only the first event after the frontend cleared the flag needs to wake it up.
+    if (!m_bkend_evt_pending.exchange(true, std::memory_order_acq_rel)) {
+        writeEvent(m_bkend_evt);
+    }
 }
 
-void CtrlIFace::send_cmd(const ReqCmd &_cmd)
+auto CtrlIFace::send_cmd(const ReqCmd &_cmd) -> ReqCmd*
 {
     auto cmd = m_cmd_alloc.alloc(_cmd);
-    {
-        std::lock_guard<std::mutex> lk(m_ftend_lck);
-        m_cmd_queue.push(cmd);
-    }
-    m_ftend_evt.notify_all();
+    m_cmd_queue.push(cmd);
+    m_ftend_bell.ring();
+    return cmd;
+}
+
+bool CtrlIFace::coalesce_dds_set(ReqOP op, uint32_t chn, bool is_override, uint32_t val)
+{
+    auto cmd = m_dds_set_cmds[op - DDSFreq][chn];
+    if (!cmd || cmd->is_override != is_override)
+        return false;
+    uint8_t state = ReqCmd::Queued;
+    if (!cmd->state.compare_exchange_strong(state, ReqCmd::Updating,
+                                            std::memory_order_relaxed))
+        return false;
+    cmd->val = val;
+    cmd->state.store(ReqCmd::Queued, std::memory_order_release);
+    return true;
 }
 
 void CtrlIFace::send_set_cmd(ReqOP op, uint32_t operand, bool is_override, uint32_t val)
 {
     set_dirty();
-    if (!concurrent_set(op, operand, is_override, val))
-        send_cmd(ReqCmd{uint8_t(op & 0xf), 0, uint8_t(is_override),
-                        operand & ((1 << 26) - 1), val});
+    if (!concurrent_set(op, operand, is_override, val)) {
+        if (op == DDSFreq || op == DDSAmp || op == DDSPhase) {
+            if (!coalesce_dds_set(op, operand, is_override, val)) {
+                m_dds_nsets[op - DDSFreq][operand]++;
+                m_dds_set_cmds[op - DDSFreq][operand] =
+                    send_cmd(ReqCmd{uint8_t(op & 0xf), 0, uint8_t(is_override),
+                                    operand & ((1 << 26) - 1), val});
+            }
+        }
+        else {
+            send_cmd(ReqCmd{uint8_t(op & 0xf), 0, uint8_t(is_override),
+                            operand & ((1 << 26) - 1), val});
+        }
+    }
     m_cmd_cache.set(op, operand, is_override, val);
 }
 
@@ -185,13 +287,18 @@ void CtrlIFace::send_get_cmd(ReqOP op, uint32_t operand, bool is_override, callb
 {
     set_observed();
     uint32_t val = 0;
-    if (concurrent_get(op, operand, is_override, val)) {
+    bool dds_set_pending = ((op == DDSFreq || op == DDSAmp || op == DDSPhase) &&
+                            m_dds_nsets[op - DDSFreq][operand]);
+    if (!dds_set_pending && concurrent_get(op, operand, is_override, val)) {
         m_cmd_cache.set(op, operand, is_override, val);
         cb(val);
         return;
     }
     if (m_cmd_cache.get(op, operand, is_override, std::move(cb)))
         return;
+    // The following set commands must not be moved before this one.
+    if (op == DDSFreq || op == DDSAmp || op == DDSPhase)
+        m_dds_set_cmds[op - DDSFreq][operand] = nullptr;
     send_cmd(ReqCmd{uint8_t(op & 0xf), 1, uint8_t(is_override),
                     operand & ((1 << 26) - 1), 0});
 }
@@ -260,6 +367,35 @@ NACS_EXPORT() void CtrlIFace::set_dds_ovr(ReqOP op, int chn, uint32_t val)
     send_set_cmd(op, chn, true, val);
 }
 
+NACS_EXPORT() void CtrlIFace::set_dds_batch(const DDSSet *sets, size_t n, bool is_override)
+{
+    set_dirty();
+    // Each command is pushed once we know whether there's another one after it.
+    ReqCmd *last = nullptr;
+    for (size_t i = 0; i < n; i++) {
+        auto op = sets[i].op;
+        uint32_t chn = sets[i].chn;
+        auto val = sets[i].val;
+        assert(op == DDSFreq || op == DDSAmp || op == DDSPhase);
+        if (!concurrent_set(op, chn, is_override, val) &&
+            !coalesce_dds_set(op, chn, is_override, val)) {
+            if (last) {
+                last->more = true;
+                m_cmd_queue.push(last);
+            }
+            last = m_cmd_alloc.alloc(ReqCmd{uint8_t(op & 0xf), 0, uint8_t(is_override),
+                                            chn & ((1 << 26) - 1), val});
+            m_dds_nsets[op - DDSFreq][chn]++;
+            m_dds_set_cmds[op - DDSFreq][chn] = last;
+        }
+        m_cmd_cache.set(op, chn, is_override, val);
+    }
+    if (last) {
+        m_cmd_queue.push(last);
+        m_ftend_bell.ring();
+    }
+}
+
 NACS_EXPORT() void CtrlIFace::get_dds(ReqOP op, int chn, callback_t cb)
 {
     assert(op == DDSFreq || op == DDSAmp || op == DDSPhase);
@@ -276,6 +412,10 @@ NACS_EXPORT() void CtrlIFace::reset_dds(int chn)
 {
     set_dirty();
     send_cmd(ReqCmd{DDSReset, 0, 0, uint32_t(chn & ((1 << 26) - 1)), 0});
+    for (auto &cmds: m_dds_set_cmds)
+        cmds[chn] = nullptr;
+    for (auto &nsets: m_dds_nsets)
+        nsets[chn]++;
     // Clear override
     m_cmd_cache.set(DDSFreq, chn, true, -1);
     m_cmd_cache.set(DDSAmp, chn, true, -1);
@@ -294,25 +434,30 @@ NACS_EXPORT() void CtrlIFace::get_clock(callback_t cb)
 
 NACS_EXPORT() void CtrlIFace::quit()
 {
-    {
-        // The lock here is overkill. However, the wait already needs a lock and we
-        // don't care about the performance here so just use the lock here...
-        std::lock_guard<std::mutex> lk(m_ftend_lck);
-        m_quit = true;
-    }
-    m_ftend_evt.notify_all();
+    m_quit.store(true, std::memory_order_relaxed);
+    m_ftend_bell.ring();
 }
 
 NACS_EXPORT() void CtrlIFace::run_frontend()
 {
     readEvent(m_bkend_evt);
+    // Clear the flag after reading the event so that any event after this point
+    // will either be observed below or wake us up again.
+    m_bkend_evt_pending.exchange(false, std::memory_order_acq_rel);
     auto run_callbacks = [&] (auto seq) {
-        auto state = seq->state.load(std::memory_order_relaxed);
+        auto state = seq->state.load(std::memory_order_acquire);
         auto pstate = seq->processed_state;
         if (state >= SeqStart && pstate < SeqStart)
             seq->notify->start(seq->id);
         if (state >= SeqFlushed && pstate < SeqFlushed)
             seq->notify->flushed(seq->id);
+        auto nfinished = seq->nfinished.load(std::memory_order_acquire);
+        if (nfinished != seq->processed_nfinished) {
+            seq->processed_nfinished = nfinished;
+            if (seq->repeat > 1) {
+                seq->notify->progress(seq->id, nfinished);
+            }
+        }
         if (state >= SeqEnd && pstate < SeqEnd)
             seq->notify->end(seq->id);
         if (state == SeqCancel && pstate != SeqCancel)
@@ -328,18 +473,51 @@ NACS_EXPORT() void CtrlIFace::run_frontend()
     // current sequence may not be the once immediately after the last finished one we
     // process if a sequence finished in between.
     auto curseq = m_seq_queue.peek_filter();
-    while (auto seq = m_seq_queue.pop()) {
-        if (curseq && curseq == seq)
+    while (true) {
+        // The backend may be done with a sequence (and moved on to the next one)
+        // before it finishes running. Keep it in the queue until it finishes.
+        auto seq = m_seq_queue.peek();
+        if (!seq.second)
+            break;
+        if (!seq_finished(seq.first)) {
+            run_callbacks(seq.first);
+            break;
+        }
+        m_seq_queue.pop();
+        m_nseqs_queued.store(queued_seqs() - 1, std::memory_order_relaxed);
+        m_seq_bytes_queued.store(queued_seq_bytes() - seq.first->mem_size,
+                                 std::memory_order_relaxed);
+        if (curseq && curseq == seq.first)
             curseq = nullptr;
-        run_callbacks(seq);
-        m_seq_alloc.free(seq);
+        run_callbacks(seq.first);
+        m_seq_stats.add(seq.first->id, seq.first->is_cmd,
+                        seq.first->processed_state == SeqCancel, seq.first->times);
+        m_seq_alloc.free(seq.first);
     }
     if (curseq)
         run_callbacks(curseq);
-    while (auto cmd = m_cmd_queue.pop()) {
-        if (cmd->has_res)
-            m_cmd_cache.set(ReqOP(cmd->opcode), cmd->operand,
-                            cmd->is_override, cmd->val);
+    while (true) {
+        // Keep the commands in the queue until the result is available.
+        auto [cmd, done] = m_cmd_queue.peek();
+        if (!done || !cmd_finished(cmd))
+            break;
+        m_cmd_queue.pop();
+        auto op = ReqOP(cmd->opcode);
+        if (cmd->has_res) {
+            m_cmd_cache.set(op, cmd->operand, cmd->is_override, cmd->val);
+        }
+        else if (op == DDSFreq || op == DDSAmp || op == DDSPhase) {
+            auto &last = m_dds_set_cmds[op - DDSFreq][cmd->operand];
+            if (last == cmd) {
+                last = nullptr;
+            }
+            m_dds_nsets[op - DDSFreq][cmd->operand]--;
+        }
+        else if (op == DDSReset) {
+            for (auto &nsets: m_dds_nsets) {
+                nsets[cmd->operand]--;
+            }
+        }
         m_cmd_alloc.free(cmd);
     }
 }
@@ -386,17 +564,12 @@ NACS_EXPORT() uint64_t CtrlIFace::get_state_id()
 NACS_EXPORT() std::pair<bool,bool> CtrlIFace::has_pending()
 {
     auto cmdres = m_cmd_queue.peek();
-    if (cmdres.second)
+    if (cmdres.second && cmd_finished(cmdres.first))
         return {true, true};
     auto seqres = m_seq_queue.peek();
-    if (seqres.second)
+    if (seqres.second && seq_finished(seqres.first))
         return {true, true};
     return {seqres.first || cmdres.first, false};
 }
 
-NACS_EXPORT() bool CtrlIFace::has_dds_ovr()
-{
-    return m_cmd_cache.has_dds_ovr();
-}
-
 }
@@ -19,18 +19,19 @@
 #ifndef LIBMOLECUBE_CTRL_IFACE_H
 #define LIBMOLECUBE_CTRL_IFACE_H
 
+#include "doorbell.h"
+#include "pulse_program.h"
 #include "pulser_common.h"
+#include "seq_stats.h"
 
 #include <nacs-utils/container.h>
 #include <nacs-utils/mem.h>
 #include <nacs-utils/utils.h>
 
 #include <atomic>
-#include <condition_variable>
 #include <functional>
-#include <map>
 #include <memory>
-#include <mutex>
+#include <new>
 #include <type_traits>
 #include <vector>
 
@@ -85,12 +86,27 @@ public:
         // After the sequence finished
         virtual void end(uint64_t)
         {}
+        // After some of the repetitions finished, with the number of finished repetitions.
+        // Called only for repeated sequences and may be coalesced.
+        virtual void progress(uint64_t, uint32_t)
+        {}
         // After the sequence is cancelled
         virtual void cancel(uint64_t)
         {}
         virtual ~ReqSeqNotify()
         {}
     };
+    // Options for running a sequence.
+    struct SeqOpts {
+        // The sequence will only start after `fire_seq` is called.
+        // The backend fills the FIFO with the beginning of the sequence
+        // so that the sequence can be started with minimum latency.
+        bool armed = false;
+        // Number of times to run the sequence.
+        uint32_t repeat = 1;
+        // Delay between the repetitions in ns.
+        uint64_t delay_ns = 0;
+    };
     // Opcode for stand alone commands.
     enum ReqOP {
         TTL,
@@ -100,35 +116,123 @@ public:
         DDSReset,
         Clock
     };
+    // One entry of `set_dds_batch`.
+    struct DDSSet {
+        ReqOP op; // DDSFreq, DDSAmp or DDSPhase
+        int chn;
+        uint32_t val;
+    };
+    // Move-only callback for the results of the commands.
+    // Small callables are stored inline without allocation.
     class callback_t {
         // C++20
         template<typename T>
         using remove_cvref_t = std::remove_cv_t<std::remove_reference_t<T>>;
+        // Large enough for the captures used in the server.
+        static constexpr size_t inline_size = 32;
         template<typename T>
-        struct Caller {
-            static void call(void *p, uint32_t v)
+        static constexpr bool is_inline = (sizeof(T) <= inline_size &&
+                                           alignof(T) <= alignof(void*) &&
+                                           std::is_nothrow_move_constructible<T>::value);
+        // `manage(dst, src)` moves the callable from `src` to `dst` and destroys
+        // the one in `src`. If `dst` is `nullptr`, only destroy the one in `src`.
+        template<typename T, bool = is_inline<T>>
+        struct Impl {
+            static T *get(void *buf)
             {
-                (*(T*)p)(v);
+                return (T*)buf;
+            }
+            template<typename T2>
+            static void init(void *buf, T2 &&v)
+            {
+                new (buf) T(std::forward<T2>(v));
+            }
+            static void manage(void *dst, void *src)
+            {
+                if (dst)
+                    new (dst) T(std::move(*get(src)));
+                get(src)->~T();
             }
         };
+        template<typename T>
+        struct Impl<T,false> {
+            static T *get(void *buf)
+            {
+                return *(T**)buf;
+            }
+            template<typename T2>
+            static void init(void *buf, T2 &&v)
+            {
+                *(T**)buf = new T(std::forward<T2>(v));
+            }
+            static void manage(void *dst, void *src)
+            {
+                if (dst) {
+                    *(T**)dst = get(src);
+                }
+                else {
+                    delete get(src);
+                }
+            }
+        };
+        template<typename T>
+        static void call(void *buf, uint32_t v)
+        {
+            (*Impl<T>::get(buf))(v);
+        }
     public:
+        // Empty callback. Must not be called.
+        callback_t() = default;
         template<typename T,
                  class=std::enable_if_t<!std::is_same<remove_cvref_t<T>,callback_t>::value>>
         callback_t(T &&v)
-            : m_ptr(std::forward<T>(v)),
-              m_fptr(Caller<remove_cvref_t<T>>::call)
-        {}
-        callback_t(callback_t &&cb)
-            : m_ptr(std::move(cb.m_ptr)),
-              m_fptr(cb.m_fptr)
-        {}
+            : m_call(call<remove_cvref_t<T>>),
+              m_manage(Impl<remove_cvref_t<T>>::manage)
+        {
+            Impl<remove_cvref_t<T>>::init(m_buf, std::forward<T>(v));
+        }
+        callback_t(callback_t &&cb) noexcept
+            : m_call(cb.m_call),
+              m_manage(cb.m_manage)
+        {
+            if (m_manage)
+                m_manage(m_buf, cb.m_buf);
+            cb.m_call = nullptr;
+            cb.m_manage = nullptr;
+        }
+        callback_t &operator=(callback_t &&cb) noexcept
+        {
+            if (this != &cb) {
+                this->~callback_t();
+                new (this) callback_t(std::move(cb));
+            }
+            return *this;
+        }
+        ~callback_t()
+        {
+            if (m_manage) {
+                m_manage(nullptr, m_buf);
+            }
+        }
+        explicit operator bool() const
+        {
+            return m_call != nullptr;
+        }
         void operator()(uint32_t v)
         {
-            m_fptr(m_ptr.get(), v);
+            m_call(m_buf, v);
         }
     private:
-        AnyPtr m_ptr;
-        void (*m_fptr)(void*, uint32_t);
+        alignas(void*) char m_buf[inline_size];
+        void (*m_call)(void*, uint32_t) = nullptr;
+        void (*m_manage)(void*, void*) = nullptr;
+    };
+    struct DDSOverrides {
+        static constexpr int ndds = 22;
+        // Bit `i` of `mask[typ]` is set if the frequency (`typ == 0`),
+        // amplitude (`1`) or phase (`2`) of DDS `i` is overriden to `val[typ][i]`.
+        uint32_t mask[3];
+        uint32_t val[3][ndds];
     };
 protected:
     /**
@@ -146,6 +250,25 @@ protected:
      */
 
     struct ReqCmd {
+        ReqCmd(uint8_t opcode, uint8_t has_res, uint8_t is_override,
+               uint32_t operand, uint32_t val)
+            : opcode(opcode & 0xf),
+              has_res(has_res & 1),
+              is_override(is_override & 1),
+              operand(operand & ((1 << 26) - 1)),
+              val(val)
+        {}
+        ReqCmd(const ReqCmd &other)
+            : ReqCmd(other.opcode, other.has_res, other.is_override, other.operand, other.val)
+        {
+            more = other.more;
+        }
+        enum State : uint8_t {
+            Queued,
+            Updating, // The frontend is changing `val`
+            Taken, // The backend started processing the command
+            Done, // The result is ready (only for commands with result)
+        };
         uint8_t opcode: 4; // ReqOP
         uint8_t has_res: 1;
         uint8_t is_override: 1; // The value set/get is override
@@ -158,6 +281,12 @@ protected:
         //    * 2: clear (set override only)
         // * 3 bits before that specify the bank number
         uint32_t val; // opcode specific encoding of value.
+        // The next command in the queue is from the same batch.
+        // Set only on commands without result.
+        bool more = false;
+        // Until the backend starts processing a DDS set command,
+        // the frontend may replace its value with the one from a newer set command.
+        std::atomic<uint8_t> state{Queued};
     };
 
     struct CmdCache {
@@ -169,21 +298,41 @@ protected:
         // If the list is not empty, return `true` since a query
         // should have been queued already.
         bool get(ReqOP op, uint32_t operand, bool is_override, callback_t cb);
-        bool has_dds_ovr();
+        bool has_dds_ovr() const
+        {
+            return (m_dds_ovrs.mask[0] | m_dds_ovrs.mask[1] | m_dds_ovrs.mask[2]) != 0;
+        }
+        const DDSOverrides &dds_ovrs() const
+        {
+            return m_dds_ovrs;
+        }
 
     private:
-        struct CacheEntry {
+        // Each entry takes exactly one cache line.
+        struct alignas(64) CacheEntry {
             uint64_t t = 0;
             uint32_t val = 0;
-            std::vector<callback_t> cbs{};
+            // There's rarely more than one query pending for the same value
+            // so the first callback is stored inline and the rest in `m_overflow`.
+            callback_t cb{};
         };
-        static uint32_t cache_key(ReqOP op, uint32_t operand, bool is_override)
+        static_assert(sizeof(CacheEntry) <= 64);
+        // DDS frequency, amplitude and phase followed by the clock.
+        // DDS overrides are only kept in `m_dds_ovrs`.
+        static constexpr int nentries = 3 * DDSOverrides::ndds + 1;
+        static int cache_idx(ReqOP op, uint32_t operand)
         {
-            assert(op != TTL);
-            assert(op != Clock || !is_override);
-            return uint32_t(op) << 27 | uint32_t(is_override) << 26 | operand;
+            assert(op != TTL && op != DDSReset);
+            if (op == Clock) {
+                assert(operand == 0);
+                return nentries - 1;
+            }
+            assert(operand < DDSOverrides::ndds);
+            return int(op - DDSFreq) * DDSOverrides::ndds + int(operand);
         }
-        std::map<uint32_t,CacheEntry> m_cache;
+        CacheEntry m_cache[nentries];
+        std::unique_ptr<std::vector<callback_t>> m_overflow[nentries];
+        DDSOverrides m_dds_ovrs{};
     };
 
     enum ReqSeqState {
@@ -193,6 +342,14 @@ protected:
         SeqFlushed,
         SeqEnd,
     };
+    enum ReqSeqArmState : uint8_t {
+        ArmInit,
+        // The beginning of the sequence is in the FIFO and the backend is waiting.
+        // Set by the backend.
+        ArmReady,
+        // Set by the frontend (`fire_seq`) or by the backend when cancelling the sequence.
+        ArmFired,
+    };
     struct ReqSeq {
         // Sequence ID
         uint64_t id;
@@ -202,21 +359,37 @@ protected:
         const uint8_t *code;
         // Length of `code`
         size_t code_len;
+        // Memory used by the sequence (see `seq_mem_size`).
+        size_t mem_size;
         // TTL's used in the sequence. Only these TTL's will be changed in the sequence.
         std::array<uint32_t,NUM_TTL_BANKS> ttl_mask;
         // version
         uint32_t ver;
         // Whether this is a command list or not. (`false` for bytecode).
         bool is_cmd;
+        // See `SeqOpts`
+        bool armed;
+        uint32_t repeat;
+        uint64_t delay_ns;
+        // The decoded `code`.
+        PulseProgram program;
         std::atomic<bool> cancel{false};
         // This is set by the backend to signal change of state.
         // Only `SeqEnd` event is guaranteed to have a accompanied event fd notification.
         std::atomic<ReqSeqState> state{SeqInit};
+        std::atomic<ReqSeqArmState> arm_state{ArmInit};
+        // Number of repetitions finished.
+        std::atomic<uint32_t> nfinished{0};
+        // Filled in by the backend before the sequence ends.
+        SeqTimes times;
         ReqSeq(uint64_t id, uint64_t seq_len_ns, const uint8_t *code, size_t code_len,
                const std::array<uint32_t,NUM_TTL_BANKS> &ttl_mask, uint32_t ver, bool is_cmd,
+               const SeqOpts &opts, PulseProgram &&program,
                std::unique_ptr<ReqSeqNotify> _notify, AnyPtr storage)
             : id(id), seq_len_ns(seq_len_ns), code(code), code_len(code_len),
-              ttl_mask(ttl_mask), ver(ver), is_cmd(is_cmd),
+              mem_size(seq_mem_size(code_len, program)), ttl_mask(ttl_mask), ver(ver), is_cmd(is_cmd), armed(opts.armed),
+              repeat(opts.repeat), delay_ns(opts.delay_ns),
+              program(std::move(program)),
               notify(std::move(_notify)), storage(std::move(storage))
         {
         }
@@ -224,6 +397,7 @@ protected:
         friend class CtrlIFace;
         // For keeping track of what callback has been invoked.
         ReqSeqState processed_state{SeqInit};
+        uint32_t processed_nfinished = 0;
         std::unique_ptr<ReqSeqNotify> notify;
         // For managing any memory associated with the request from the frontend.
         // Most likely for the `code`.
@@ -242,6 +416,14 @@ protected:
      */
     bool wait(int64_t maxt=-1);
 
+    /**
+     * Wait for a new command while a sequence is running.
+     * Wait for at most `maxt` nanoseconds. If `maxt < 0`, do not time out.
+     *
+     * Return true if there's a command to process.
+     */
+    bool wait_cmd(int64_t maxt);
+
     /**
      * Try popping a command from the queue.
      */
@@ -253,7 +435,9 @@ protected:
     ReqSeq *get_seq();
 
     /**
-     * Finishing a command
+     * Finishing a command.
+     * The result of a command with result can be set later
+     * together with the `Done` state.
      */
     void finish_cmd();
 
@@ -267,10 +451,9 @@ protected:
     /**
      * Generate a backend event.
      * This notify the frontend that something it can read have changed.
-     * Not all changes will generate this event, only the ones that are not
-     * latency critical in the backend will.
-     * The frontend is expected to poll the backend periodically
-     * if it is waiting for something.
+     * The backend must call this after every state change of a sequence or command.
+     * Events are coalesced until the frontend runs so this is cheap
+     * when called repeatedly.
      */
     void backend_event();
 
@@ -299,6 +482,17 @@ protected:
         (void)val;
         return false;
     }
+    /**
+     * Wait for the armed sequence to be fired or cancelled or for the backend to quit.
+     * Wait for at most `maxt` nanoseconds. If `maxt < 0`, do not time out.
+     *
+     * Return true if any of these happened.
+     */
+    bool wait_armed(ReqSeq *seq, int64_t maxt);
+    bool quitting() const
+    {
+        return m_quit.load(std::memory_order_relaxed);
+    }
     CtrlIFace();
 public:
     virtual ~CtrlIFace() {}
@@ -322,9 +516,38 @@ public:
                       const uint8_t *code, size_t code_len,
                       std::unique_ptr<ReqSeqNotify> notify, Args&&... args)
     {
-        return _run_code(is_cmd, ver, seq_len_ns, ttl_mask, code, code_len,
+        return _run_code(SeqOpts(), is_cmd, ver, seq_len_ns, ttl_mask, code, code_len,
+                         decode_code(is_cmd, ver, code, code_len),
+                         std::move(notify), AnyPtr(std::forward<Args>(args)...));
+    }
+    template<typename... Args>
+    uint64_t run_code(const SeqOpts &opts, bool is_cmd, uint32_t ver, uint64_t seq_len_ns,
+                      const std::array<uint32_t,NUM_TTL_BANKS> &ttl_mask,
+                      const uint8_t *code, size_t code_len,
+                      std::unique_ptr<ReqSeqNotify> notify, Args&&... args)
+    {
+        return _run_code(opts, is_cmd, ver, seq_len_ns, ttl_mask, code, code_len,
+                         decode_code(is_cmd, ver, code, code_len),
                          std::move(notify), AnyPtr(std::forward<Args>(args)...));
     }
+    // Same as above with `program` returned by `decode_code` on the same code.
+    template<typename... Args>
+    uint64_t run_code(const SeqOpts &opts, bool is_cmd, uint32_t ver, uint64_t seq_len_ns,
+                      const std::array<uint32_t,NUM_TTL_BANKS> &ttl_mask,
+                      const uint8_t *code, size_t code_len, PulseProgram &&program,
+                      std::unique_ptr<ReqSeqNotify> notify, Args&&... args)
+    {
+        return _run_code(opts, is_cmd, ver, seq_len_ns, ttl_mask, code, code_len,
+                         std::move(program), std::move(notify),
+                         AnyPtr(std::forward<Args>(args)...));
+    }
+    // Decode the sequence for `run_code`.
+    // Unlike the rest of the frontend API, this can be called from any thread.
+    static PulseProgram decode_code(bool is_cmd, uint32_t ver,
+                                    const uint8_t *code, size_t code_len);
+    // Start the armed sequence determined by `id`.
+    // Return `false` if the sequence is not armed, not found or has already been fired.
+    bool fire_seq(uint64_t id);
     // Cancel the sequence determined by the `id`. `id == 0` means cancel all sequences.
     // Return if any sequences may be cancelled.
     // Note that a cancelled sequence that has been started
@@ -343,22 +566,60 @@ public:
 
     void set_dds(ReqOP op, int chn, uint32_t val);
     void set_dds_ovr(ReqOP op, int chn, uint32_t val);
+    // Same as calling `set_dds` or `set_dds_ovr` on each of the `n` entries
+    // but the backend is only notified once and runs all of them together.
+    void set_dds_batch(const DDSSet *sets, size_t n, bool is_override);
 
     void get_dds(ReqOP op, int chn, callback_t cb);
     void get_dds_ovr(ReqOP op, int chn, callback_t cb);
     void reset_dds(int chn);
     virtual void set_dds_timing1(int adsu, int wrlow, int adhd, int fuddl, int fudhd) = 0;
+    // Send the sequences to the FPGA with DMA instead of writing the registers
+    // for each pulse. Ignored if DMA buffers cannot be allocated.
+    virtual void set_use_dma(bool use_dma) = 0;
+    // Cancel an armed sequence if it is not fired within `timeout_ns` after the FIFO
+    // is filled. `0` for no timeout.
+    virtual void set_arm_timeout(uint64_t timeout_ns) = 0;
 
     void set_clock(uint8_t val);
     void get_clock(callback_t cb);
 
     virtual bool has_ttl_ovr() = 0;
-    bool has_dds_ovr();
+    bool has_dds_ovr() const
+    {
+        return m_cmd_cache.has_dds_ovr();
+    }
+    const DDSOverrides &get_dds_ovrs() const
+    {
+        return m_cmd_cache.dds_ovrs();
+    }
 
     void quit();
     uint64_t get_state_id();
+    // Statistics of the finished sequences.
+    const SeqStats &get_seq_stats() const
+    {
+        return m_seq_stats;
+    }
+    // Number of sequences queued or running and the total memory used by them.
+    // These are updated by the frontend thread but can be read from any thread.
+    size_t queued_seqs() const
+    {
+        return m_nseqs_queued.load(std::memory_order_relaxed);
+    }
+    size_t queued_seq_bytes() const
+    {
+        return m_seq_bytes_queued.load(std::memory_order_relaxed);
+    }
+    // Memory used by a queued sequence, i.e. the code and the decoded program.
+    static size_t seq_mem_size(size_t code_len, const PulseProgram &program)
+    {
+        return code_len + program.insts().size() * sizeof(PulseProgram::Inst);
+    }
 
     virtual std::vector<int> get_active_dds() = 0;
+    // Same as `get_active_dds` as a bit mask.
+    virtual uint32_t get_active_dds_mask() = 0;
 
     // Return whether there is any sequence or command waiting to be or being processed
     // and whether any of them are finished and ready to be freed/trigger the callbacks.
@@ -368,29 +629,44 @@ public:
     static std::unique_ptr<CtrlIFace> create(bool dummy=false);
 
 private:
-    uint64_t _run_code(bool is_cmd, uint32_t ver, uint64_t seq_len_ns,
+    uint64_t _run_code(const SeqOpts &opts, bool is_cmd, uint32_t ver, uint64_t seq_len_ns,
                        const std::array<uint32_t,NUM_TTL_BANKS> &ttl_mask,
-                       const uint8_t *code, size_t code_len,
+                       const uint8_t *code, size_t code_len, PulseProgram &&program,
                        std::unique_ptr<ReqSeqNotify> notify, AnyPtr storage);
 
     void set_dirty();
     void set_observed();
+    static bool seq_finished(ReqSeq *seq)
+    {
+        auto state = seq->state.load(std::memory_order_acquire);
+        return state == SeqCancel || state == SeqEnd;
+    }
+    // The backend may be done with a command with result before the result is read back.
+    static bool cmd_finished(ReqCmd *cmd)
+    {
+        return !cmd->has_res || cmd->state.load(std::memory_order_acquire) == ReqCmd::Done;
+    }
 
-    void send_cmd(const ReqCmd &cmd);
+    ReqCmd *send_cmd(const ReqCmd &cmd);
+    // Update the last queued set command of the same DDS parameter instead of
+    // queuing a new one if the backend hasn't started processing it yet.
+    bool coalesce_dds_set(ReqOP op, uint32_t chn, bool is_override, uint32_t val);
     void send_set_cmd(ReqOP op, uint32_t operand, bool is_override, uint32_t val);
     void send_get_cmd(ReqOP op, uint32_t operand, bool is_override, callback_t cb);
 
     void send_ttl_set_cmd(uint32_t operand, bool is_override, uint32_t val);
     uint32_t send_ttl_get_cmd(uint32_t operand, bool is_override);
 
-    bool m_quit{false};
+    std::atomic<bool> m_quit{false};
 
     // To notify the backend of new requests from the frontend.
-    std::mutex m_ftend_lck;
-    std::condition_variable m_ftend_evt;
+    // Only rung when the backend is waiting.
+    Doorbell m_ftend_bell;
 
     // Sequence ID counter
     uint64_t m_seq_cnt = 0;
+    std::atomic<size_t> m_nseqs_queued{0};
+    std::atomic<size_t> m_seq_bytes_queued{0};
     // State ID counter
     uint64_t m_state_cnt = 0;
     bool m_dirty = false;
@@ -399,6 +675,12 @@ private:
 
     // The queues that send the commands/sequences to the backend (filter) and back.
     FilterQueue<ReqCmd> m_cmd_queue;
+    // The last queued command for each DDS parameter of each channel
+    // if it's a set command that may still be updated.
+    ReqCmd *m_dds_set_cmds[3][22] = {};
+    // Number of unfinished set (or reset) commands for each DDS parameter of each channel.
+    // The values read from the hardware directly don't include these changes.
+    uint32_t m_dds_nsets[3][22] = {};
     FilterQueue<ReqSeq> m_seq_queue;
 
     // Cached allocator for efficient allocations
@@ -406,10 +688,13 @@ private:
     SmallAllocator<ReqSeq,32> m_seq_alloc;
 
     CmdCache m_cmd_cache;
+    SeqStats m_seq_stats;
 
     // Use an event fd for notification from the backend to the frontend
     // since this can be polled in the main loop.
     int m_bkend_evt;
+    // Whether `m_bkend_evt` has been signaled since the last `run_frontend`.
+    std::atomic<bool> m_bkend_evt_pending{false};
 };
 
 }
@@ -0,0 +1,204 @@
+/*************************************************************************
+ *   Copyright (c) 2018 - 2018 Yichao Yu <yyc1992@gmail.com>             *
+ *                                                                       *
+ *   This library is free software; you can redistribute it and/or       *
+ *   modify it under the terms of the GNU Lesser General Public          *
+ *   License as published by the Free Software Foundation; either        *
+ *   version 3.0 of the License, or (at your option) any later version.  *
+ *                                                                       *
+ *   This library is distributed in the hope that it will be useful,     *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU    *
+ *   Lesser General Public License for more details.                     *
+ *                                                                       *
+ *   You should have received a copy of the GNU Lesser General Public    *
+ *   License along with this library. If not,                            *
+ *   see <http://www.gnu.org/licenses/>.                                 *
+ *************************************************************************/
+
+#ifndef LIBMOLECUBE_DMA_STREAM_H
+#define LIBMOLECUBE_DMA_STREAM_H
+
+#include "pulser_common.h"
+
+#include <nacs-seq/zynq/pulse_time.h>
+#include <nacs-utils/utils.h>
+
+#include <assert.h>
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+namespace Molecube {
+
+using namespace NaCs;
+
+/**
+ * Lower pulses into a ring of DMA buffers allocated with `Pulser::alloc_buffer`
+ * so that the FPGA can fetch them without the CPU writing each pulse to the registers.
+ *
+ * This provides the same pulse API as the pulsers (through `PulseEncoder`).
+ * Each buffer is handed to the FPGA with `Pulser::start_dma` as soon as it is filled
+ * and the producer waits for the FPGA to fetch the oldest buffer before
+ * reusing it, i.e. the stream can be arbitrarily long but is never more than
+ * `ring_size` buffers ahead of the FPGA.
+ *
+ * The pulse functions, `reset` and `finish` should be called from a single producer thread.
+ * The other functions can be called from any thread.
+ */
+template<typename Pulser>
+class DMAStream : public PulseEncoder<DMAStream<Pulser>> {
+    DMAStream(const DMAStream&) = delete;
+    void operator=(const DMAStream&) = delete;
+
+public:
+    // Number of blocks in each buffer.
+    static constexpr uint32_t chunk_blocks = 64;
+    static constexpr uint32_t chunk_size = chunk_blocks * DMA_BLOCK_SIZE;
+    // Number of buffers in the ring.
+    static constexpr uint32_t ring_size = 8;
+
+    DMAStream(Pulser &p)
+        : m_p(p)
+    {
+    }
+    ~DMAStream()
+    {
+        for (auto &chunk: m_chunks) {
+            Pulser::free_buffer(chunk.buff, chunk_size);
+        }
+    }
+
+    template<bool checked>
+    inline void pulse(uint32_t ctrl, uint32_t op)
+    {
+        if (checked)
+            ctrl = ctrl | PulseCtrl::TimeCheck;
+        if (unlikely(m_ptr == m_end))
+            next_chunk();
+        m_ptr[0] = op;
+        m_ptr[1] = ctrl;
+        m_ptr += 2;
+    }
+
+    // Allocate the buffers. Returns `false` if the DMA buffers are not available.
+    bool init()
+    {
+        while (m_chunks.size() < ring_size) {
+            auto buff = (uint32_t*)Pulser::alloc_buffer(chunk_size);
+            if (!buff)
+                return false;
+            m_chunks.push_back(Chunk{buff, Pulser::buffer_addr(buff)});
+        }
+        return true;
+    }
+    // Start a new stream.
+    void reset()
+    {
+        m_cur = 0;
+        m_nchunks = 0;
+        m_ptr = m_chunks[0].buff;
+        m_queued = m_ptr;
+        m_end = m_ptr + chunk_size / 4;
+        m_blocks_queued.store(0, std::memory_order_relaxed);
+        m_started.store(false, std::memory_order_relaxed);
+    }
+    // Pad the last block and queue all the remaining blocks.
+    void finish()
+    {
+        // Fill the rest of the last block with short unchecked waits
+        // since the FPGA can only fetch full blocks.
+        while (pulses_to_block_end())
+            this->template wait<false>(Seq::Zynq::PulseTime::Min);
+        queue_blocks();
+    }
+    // Number of pulses needed to fill the current block.
+    uint32_t pulses_to_block_end() const
+    {
+        auto pos = uint32_t(m_ptr - m_chunks[m_cur].buff) / 2;
+        return (block_pulses - pos % block_pulses) % block_pulses;
+    }
+    // Queue the filled blocks right away without waiting for the rest of the buffer.
+    // Used to avoid starving the FPGA when the producer stops for a while.
+    // The current block must be full (see `pulses_to_block_end`).
+    void flush()
+    {
+        assert(pulses_to_block_end() == 0);
+        queue_blocks();
+    }
+    // The FPGA has started executing the stream.
+    // Running out of queued blocks from now on is an underrun.
+    void set_started()
+    {
+        m_started.store(true, std::memory_order_relaxed);
+    }
+    // Number of blocks queued in the current stream.
+    uint32_t blocks_queued() const
+    {
+        return m_blocks_queued.load(std::memory_order_acquire);
+    }
+    // Number of times the FPGA fetched all the queued blocks before the stream finishes.
+    uint64_t underruns() const
+    {
+        return m_underruns.load(std::memory_order_relaxed);
+    }
+
+private:
+    struct Chunk {
+        uint32_t *buff;
+        uintptr_t addr;
+    };
+    static constexpr uint32_t block_pulses = DMA_BLOCK_SIZE / 8;
+    // Queue the full blocks in the current buffer that haven't been queued.
+    void queue_blocks()
+    {
+        auto &chunk = m_chunks[m_cur];
+        auto blocks = uint32_t(m_ptr - m_queued) / (DMA_BLOCK_SIZE / 4);
+        if (!blocks)
+            return;
+        auto queued = m_blocks_queued.load(std::memory_order_relaxed);
+        if (queued > 0 && m_started.load(std::memory_order_relaxed) && !m_p.dma_busy())
+            m_underruns.fetch_add(1, std::memory_order_relaxed);
+        m_p.start_dma(chunk.addr + uintptr_t(m_queued - chunk.buff) * 4,
+                      uint16_t(blocks), queued == 0);
+        m_queued += blocks * (DMA_BLOCK_SIZE / 4);
+        m_blocks_queued.store(queued + blocks, std::memory_order_release);
+    }
+    void next_chunk()
+    {
+        queue_blocks();
+        m_nchunks++;
+        m_cur = (m_cur + 1) % ring_size;
+        m_ptr = m_chunks[m_cur].buff;
+        m_queued = m_ptr;
+        m_end = m_ptr + chunk_size / 4;
+        if (m_nchunks < ring_size)
+            return;
+        // Wait for the FPGA to fetch the buffer before overwriting it.
+        // The block counter from the FPGA wraps around at 16 bits, which is much more than
+        // the number of blocks in the ring.
+        auto queued = blocks_queued();
+        while (uint16_t(queued - m_p.dma_blocks_done()) > (ring_size - 1) * chunk_blocks) {
+            using namespace std::literals;
+            std::this_thread::sleep_for(100us);
+        }
+    }
+
+    Pulser &m_p;
+    std::vector<Chunk> m_chunks;
+    uint32_t m_cur = 0;
+    uint32_t m_nchunks = 0;
+    uint32_t *m_ptr = nullptr;
+    // The part of the current buffer before this is queued.
+    uint32_t *m_queued = nullptr;
+    uint32_t *m_end = nullptr;
+    std::atomic<uint32_t> m_blocks_queued{0};
+    std::atomic<bool> m_started{false};
+    std::atomic<uint64_t> m_underruns{0};
+};
+
+}
+
+#endif
@@ -0,0 +1,48 @@
+/*************************************************************************
+ *   Copyright (c) 2018 - 2018 Yichao Yu <yyc1992@gmail.com>             *
+ *                                                                       *
+ *   This library is free software; you can redistribute it and/or       *
+ *   modify it under the terms of the GNU Lesser General Public          *
+ *   License as published by the Free Software Foundation; either        *
+ *   version 3.0 of the License, or (at your option) any later version.  *
+ *                                                                       *
+ *   This library is distributed in the hope that it will be useful,     *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU    *
+ *   Lesser General Public License for more details.                     *
+ *                                                                       *
+ *   You should have received a copy of the GNU Lesser General Public    *
+ *   License along with this library. If not,                            *
+ *   see <http://www.gnu.org/licenses/>.                                 *
+ *************************************************************************/
+
+#include "doorbell.h"
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace Molecube {
+
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t));
+
+NACS_EXPORT() void Doorbell::sleep(uint32_t seq, int64_t timeout)
+{
+    timespec ts;
+    timespec *pts = nullptr;
+    if (timeout >= 0) {
+        ts.tv_sec = time_t(timeout / 1000000000);
+        ts.tv_nsec = long(timeout % 1000000000);
+        pts = &ts;
+    }
+    // Returns immediately if `m_seq` has changed.
+    syscall(SYS_futex, &m_seq, FUTEX_WAIT_PRIVATE, seq, pts, nullptr, 0);
+}
+
+NACS_EXPORT() void Doorbell::wake()
+{
+    syscall(SYS_futex, &m_seq, FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+}
+
+}
@@ -0,0 +1,96 @@
+/*************************************************************************
+ *   Copyright (c) 2018 - 2018 Yichao Yu <yyc1992@gmail.com>             *
+ *                                                                       *
+ *   This library is free software; you can redistribute it and/or       *
+ *   modify it under the terms of the GNU Lesser General Public          *
+ *   License as published by the Free Software Foundation; either        *
+ *   version 3.0 of the License, or (at your option) any later version.  *
+ *                                                                       *
+ *   This library is distributed in the hope that it will be useful,     *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU    *
+ *   Lesser General Public License for more details.                     *
+ *                                                                       *
+ *   You should have received a copy of the GNU Lesser General Public    *
+ *   License along with this library. If not,                            *
+ *   see <http://www.gnu.org/licenses/>.                                 *
+ *************************************************************************/
+
+#ifndef LIBMOLECUBE_DOORBELL_H
+#define LIBMOLECUBE_DOORBELL_H
+
+#include <nacs-utils/timer.h>
+#include <nacs-utils/utils.h>
+
+#include <atomic>
+#include <stdint.h>
+
+namespace Molecube {
+
+using namespace NaCs;
+
+/**
+ * Wake up a single waiting thread with a futex.
+ *
+ * The waiter announces that it is going to sleep before checking for work
+ * one last time so `ring` only needs a system call when the waiter is (about to be)
+ * parked. The common case of ringing a busy waiter costs a fence and a load.
+ */
+class Doorbell {
+    Doorbell(const Doorbell&) = delete;
+    void operator=(const Doorbell&) = delete;
+
+public:
+    Doorbell() = default;
+
+    // The work must be published before calling this.
+    void ring()
+    {
+        // Pairs with the fence in `wait` so that either the waiter sees the work
+        // or we see the waiter parked.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!m_parked.load(std::memory_order_relaxed))
+            return;
+        m_seq.fetch_add(1, std::memory_order_relaxed);
+        wake();
+    }
+    // Wait until `ready()` returns `true` or `timeout` (in ns) expires.
+    // A negative `timeout` means no timeout. Returns the last result of `ready()`.
+    template<typename Pred>
+    bool wait(Pred &&ready, int64_t timeout)
+    {
+        auto deadline = timeout > 0 ? getTime() + uint64_t(timeout) : 0;
+        while (!ready()) {
+            int64_t left = -1;
+            if (timeout == 0) {
+                return false;
+            }
+            else if (timeout > 0) {
+                auto t = getTime();
+                if (t >= deadline)
+                    return false;
+                left = int64_t(deadline - t);
+            }
+            auto seq = m_seq.load(std::memory_order_relaxed);
+            m_parked.store(true, std::memory_order_relaxed);
+            // Check again after announcing that we are going to sleep.
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (!ready())
+                sleep(seq, left);
+            m_parked.store(false, std::memory_order_relaxed);
+        }
+        return true;
+    }
+
+private:
+    // Sleep if `m_seq` is still `seq`.
+    void sleep(uint32_t seq, int64_t timeout);
+    void wake();
+
+    std::atomic<uint32_t> m_seq{0};
+    std::atomic<bool> m_parked{false};
+};
+
+}
+
+#endif
@@ -92,7 +92,7 @@ NACS_EXPORT() void DummyPulser::add_cmd(OP op, bool timing, uint32_t v1, uint32_
 {
     Cmd cmd{op, timing, std::chrono::steady_clock::now(), v1, v2};
     std::unique_lock<std::mutex> lock(m_cmds_lock);
-    while (m_cmds.size() >= 4096) {
+    while (m_cmds.size() >= max_cmd_count) {
         if (!m_force_release) {
             m_force_release = true;
             m_release_time = std::chrono::steady_clock::now();
@@ -103,6 +103,114 @@ NACS_EXPORT() void DummyPulser::add_cmd(OP op, bool timing, uint32_t v1, uint32_
     m_cmds_empty.store(false, std::memory_order_release);
 }
 
+NACS_EXPORT() void DummyPulser::start_dma(uintptr_t addr, uint16_t blocks, bool first)
+{
+    assert((addr & (DMA_BLOCK_SIZE - 1)) == 0);
+    auto ptr = (const uint32_t*)addr;
+    std::unique_lock<std::mutex> lock(m_cmds_lock);
+    if (first)
+        m_dma_fetched = 0;
+    m_dma_blocks.push(DMABlocks{ptr, ptr + blocks * (DMA_BLOCK_SIZE / 4)});
+    fetch_dma(std::chrono::steady_clock::now());
+}
+
+NACS_EXPORT() uint16_t DummyPulser::read_dds(uint8_t chn, uint8_t addr)
+{
+    if (!dds_exists_internal(chn))
+        return 0;
+    forward_time();
+    std::unique_lock<std::mutex> lock(m_cmds_lock);
+    auto &dds = m_dds[chn];
+    switch (addr) {
+    case 0x2c:
+        return uint16_t(dds.freq);
+    case 0x2e:
+        return uint16_t(dds.freq >> 16);
+    case 0x30:
+        return dds.phase;
+    case 0x32:
+        return dds.amp;
+    default:
+        return 0;
+    }
+}
+
+NACS_EXPORT() uint32_t DummyPulser::dma_status() const
+{
+    auto self = const_cast<DummyPulser*>(this);
+    self->forward_time();
+    std::unique_lock<std::mutex> lock(self->m_cmds_lock);
+    return uint32_t(!m_dma_blocks.empty()) |
+        (uint32_t(m_dma_fetched / DMA_BLOCK_PULSES) << 16);
+}
+
+NACS_INTERNAL void DummyPulser::fetch_dma(time_point_t t)
+{
+    while (!m_dma_blocks.empty() && m_cmds.size() < max_cmd_count) {
+        auto &blocks = m_dma_blocks.front();
+        m_cmds.push(decode_pulse(blocks.ptr[1], blocks.ptr[0], t));
+        m_cmds_empty.store(false, std::memory_order_release);
+        m_dma_fetched++;
+        blocks.ptr += 2;
+        if (blocks.ptr == blocks.end) {
+            m_dma_blocks.pop();
+        }
+    }
+}
+
+NACS_INTERNAL auto DummyPulser::decode_pulse(uint32_t ctrl, uint32_t op,
+                                             time_point_t t) -> Cmd
+{
+    bool timing = ctrl & PulseCtrl::TimeCheck;
+    switch (ctrl & PulseCtrl::TypeMask) {
+    case PulseCtrl::TTL:
+        return Cmd{OP::TTL, timing, t, ctrl & ~uint32_t(PulseCtrl::TimeCheck), op};
+    case PulseCtrl::DDS: {
+        uint32_t chn = (ctrl >> 4) & 0x1f;
+        uint32_t addr = ((ctrl >> 9) & 0x7f) - 1;
+        switch (ctrl & 0xf) {
+        case 0x0:
+            return Cmd{OP::DDSSetFreq, timing, t, chn, op};
+        case 0x2:
+            if (addr == 0x32)
+                return Cmd{OP::DDSSetAmp, timing, t, chn, op};
+            if (addr == 0x30)
+                return Cmd{OP::DDSSetPhase, timing, t, chn, op};
+            break;
+        case 0x3:
+            if (addr == 0x32)
+                return Cmd{OP::DDSGetAmp, timing, t, chn, 0};
+            if (addr == 0x30)
+                return Cmd{OP::DDSGetPhase, timing, t, chn, 0};
+            break;
+        case 0x4:
+            return Cmd{OP::DDSReset, timing, t, chn, 0};
+        case 0xe:
+            if (addr == 0x2c)
+                return Cmd{OP::DDSGetFreq, timing, t, chn, 0};
+            break;
+        default:
+            break;
+        }
+        break;
+    }
+    case PulseCtrl::Wait:
+        // Trigger isn't supported so both wait and wait_trigger are treated as wait.
+        return Cmd{OP::Wait, timing, t, ctrl & max_wait_t, 0};
+    case PulseCtrl::ClearErr:
+        return Cmd{OP::ClearErr, timing, t, 0, 0};
+    case PulseCtrl::LoopBack:
+        return Cmd{OP::LoopBack, timing, t, op, 0};
+    case PulseCtrl::ClockOut:
+        return Cmd{OP::Clock, timing, t, op & 0xff, 0};
+    case PulseCtrl::SPI:
+        return Cmd{OP::DAC, timing, t, (op >> 16) & 3, op & 0xffff};
+    default:
+        break;
+    }
+    throw std::runtime_error("Unsupported DMA pulse.");
+}
+
 NACS_EXPORT() void DummyPulser::release_hold()
 {
     // Protecting access to `m_release_time` and `m_hold`
@@ -127,8 +235,16 @@ NACS_EXPORT() void DummyPulser::set_hold()
 
 NACS_EXPORT() void DummyPulser::toggle_init()
 {
-    if (!m_cmds_empty.load(std::memory_order_acquire))
-        throw std::runtime_error("Command stream not empty during init.");
+    if (!m_cmds_empty.load(std::memory_order_acquire)) {
+        // Init clears the commands that are held in the FIFO (e.g. for an armed sequence
+        // that is cancelled). The FIFO is not supposed to be running otherwise.
+        std::unique_lock<std::mutex> lock(m_cmds_lock);
+        if (!m_hold || m_force_release)
+            throw std::runtime_error("Command stream not empty during init.");
+        m_cmds = {};
+        m_dma_blocks = {};
+        m_cmds_empty.store(true, std::memory_order_release);
+    }
     m_force_release = false;
     m_timing_ok.store(true, std::memory_order_release);
     m_timing_check.store(false, std::memory_order_release);
@@ -144,6 +260,9 @@ NACS_EXPORT() void DummyPulser::forward_time(bool block, std::unique_lock<std::m
     do {
         auto cur_t = std::chrono::steady_clock::now();
         if (cur_t < m_release_time) {
+            // Reading the state from the hardware should not wait for the current pulse.
+            if (!block)
+                return;
             locker.unlock();
             std::this_thread::sleep_until(m_release_time);
             locker.lock();
@@ -178,6 +297,8 @@ NACS_INTERNAL bool DummyPulser::run_past_cmds(time_point_t cur_t)
         auto steps = run_cmd(cmd);
         m_release_time = startt + std::chrono::nanoseconds(steps * 10);
         m_cmds.pop();
+        // The DMA engine refills the queue as soon as there's space.
+        fetch_dma(startt);
     }
     m_cmds_empty.store(true, std::memory_order_release);
     return cmd_run;
@@ -237,12 +358,15 @@ NACS_INTERNAL uint32_t DummyPulser::run_cmd(const Cmd &cmd)
 
 _NACS_EXPORT
 DummyPulser::DummyPulser(DummyPulser &&o)
-    : m_clock(o.m_clock.load(std::memory_order_relaxed)),
+    : m_dma_control(o.m_dma_control.load(std::memory_order_relaxed)),
+      m_clock(o.m_clock.load(std::memory_order_relaxed)),
       m_cmds_empty(o.m_cmds_empty.load(std::memory_order_relaxed)),
       m_timing_ok(o.m_timing_ok.load(std::memory_order_relaxed)),
       m_timing_check(o.m_timing_check.load(std::memory_order_relaxed)),
       m_results(std::move(o.m_results)),
       m_cmds(std::move(o.m_cmds)),
+      m_dma_blocks(std::move(o.m_dma_blocks)),
+      m_dma_fetched(o.m_dma_fetched),
       m_hold(o.m_hold),
       m_force_release(o.m_force_release),
       m_dds(o.m_dds),
@@ -255,12 +379,17 @@ DummyPulser::DummyPulser(DummyPulser &&o)
                           std::memory_order_relaxed);
         m_ttl[i].store(o.m_ttl[i].load(std::memory_order_relaxed),
                        std::memory_order_relaxed);
+        m_dma_ttl_mask[i].store(o.m_dma_ttl_mask[i].load(std::memory_order_relaxed),
+                                std::memory_order_relaxed);
     }
 }
 
 NACS_EXPORT() void *DummyPulser::alloc_buffer(size_t size)
 {
-    return malloc(size);
+    void *buff;
+    if (posix_memalign(&buff, DMA_BLOCK_SIZE, size) != 0)
+        return nullptr;
+    return buff;
 }
 NACS_EXPORT() uintptr_t DummyPulser::buffer_addr(void *buff)
 {
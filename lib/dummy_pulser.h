@@ -124,6 +124,19 @@ public:
         assert(bank >= 0 && bank < NUM_TTL_BANKS);
         return m_dma_ttl_mask[bank].load(std::memory_order_acquire);
     }
+    uint32_t dma_status() const;
+    inline uint32_t dma_control() const
+    {
+        return m_dma_control.load(std::memory_order_acquire);
+    }
+    inline bool dma_busy() const
+    {
+        return dma_status() & 1;
+    }
+    inline uint16_t dma_blocks_done() const
+    {
+        return uint16_t(dma_status() >> 16);
+    }
 
     // Write
     inline void set_ttl_himask(uint32_t high_mask, int bank)
@@ -141,6 +154,14 @@ public:
         assert(bank >= 0 && bank < NUM_TTL_BANKS);
         m_dma_ttl_mask[bank].store(mask, std::memory_order_release);
     }
+    inline void set_dma_control(uint32_t ctrl)
+    {
+        m_dma_control.store(ctrl, std::memory_order_release);
+    }
+    // The blocks are fetched into the command queue as if they are sent by `add_cmd`
+    // whenever there's space in the queue.
+    // The `addr` is the one returned by `buffer_addr`.
+    void start_dma(uintptr_t addr, uint16_t blocks, bool first);
     void release_hold();
     void set_hold();
     void toggle_init();
@@ -230,6 +251,17 @@ public:
         wait<checked>(timeout);
     }
 
+    // Read the DDS memory.
+    // Only the frequency, amplitude and phase registers are implemented.
+    inline uint16_t read_dds0(uint8_t dds_id, uint8_t dds_addr)
+    {
+        return read_dds(dds_id, dds_addr);
+    }
+    inline uint16_t read_dds1(uint8_t dds_id, uint8_t dds_addr)
+    {
+        return read_dds(dds_id, dds_addr);
+    }
+
     // Debug registers
     inline uint32_t loopback_reg()
     {
@@ -275,6 +307,8 @@ private:
         return 0 <= chn && chn < NDDS;
     }
 
+    uint16_t read_dds(uint8_t chn, uint8_t addr);
+
     // Push a result to the result queue. Check if there's overflow
     void add_result(uint32_t v);
     // Add a command to the command queue.
@@ -297,14 +331,21 @@ private:
     // Run the commands that should be executed before the specified time.
     // Return if any command is run
     bool run_past_cmds(time_point_t t);
+    // Move pulses from the queued DMA blocks to the command queue
+    // until the command queue is full. `t` is the time the pulses are fetched.
+    void fetch_dma(time_point_t t);
+    // Decode a pulse in the format used by the FPGA.
+    Cmd decode_pulse(uint32_t ctrl, uint32_t op, time_point_t t);
 
     static constexpr int NDDS = 22;
     static constexpr uint32_t max_result_count = 4097;
+    static constexpr uint32_t max_cmd_count = 4096;
 
     std::array<std::atomic<uint32_t>,NUM_TTL_BANKS> m_ttl_hi{0};
     std::array<std::atomic<uint32_t>,NUM_TTL_BANKS> m_ttl_lo{0};
     std::array<std::atomic<uint32_t>,NUM_TTL_BANKS> m_ttl{0};
     std::array<std::atomic<uint32_t>,NUM_TTL_BANKS> m_dma_ttl_mask{0};
+    std::atomic<uint32_t> m_dma_control{0};
     std::atomic<uint8_t> m_clock{255};
     std::atomic<bool> m_cmds_empty{true};
     std::atomic<bool> m_timing_ok{true};
@@ -319,6 +360,12 @@ private:
     // It has the same semantic as the hardware one and that's more important.
     std::queue<uint32_t> m_results;
     std::queue<Cmd> m_cmds;
+    struct DMABlocks {
+        const uint32_t *ptr;
+        const uint32_t *end;
+    };
+    std::queue<DMABlocks> m_dma_blocks;
+    size_t m_dma_fetched{0};
     bool m_hold{false};
     bool m_force_release{false};
 
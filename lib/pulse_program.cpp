@@ -0,0 +1,44 @@
+/*************************************************************************
+ *   Copyright (c) 2018 - 2018 Yichao Yu <yyc1992@gmail.com>             *
+ *                                                                       *
+ *   This library is free software; you can redistribute it and/or       *
+ *   modify it under the terms of the GNU Lesser General Public          *
+ *   License as published by the Free Software Foundation; either        *
+ *   version 3.0 of the License, or (at your option) any later version.  *
+ *                                                                       *
+ *   This library is distributed in the hope that it will be useful,     *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU    *
+ *   Lesser General Public License for more details.                     *
+ *                                                                       *
+ *   You should have received a copy of the GNU Lesser General Public    *
+ *   License along with this library. If not,                            *
+ *   see <http://www.gnu.org/licenses/>.                                 *
+ *************************************************************************/
+
+#include "pulse_program.h"
+
+#include <nacs-seq/zynq/bytecode.h>
+#include <nacs-seq/zynq/cmdlist.h>
+
+namespace Molecube {
+
+NACS_EXPORT() void PulseProgram::decode(bool is_cmd, uint32_t ver,
+                                        const uint8_t *code, size_t code_len)
+{
+    m_insts.clear();
+    if (unlikely(is_cmd)) {
+        Seq::Zynq::CmdList::ExeState exestate;
+        if (ver > 1)
+            exestate.min_time = Seq::Zynq::PulseTime::Min2;
+        exestate.run(*this, code, code_len, ver);
+    }
+    else {
+        Seq::Zynq::ByteCode::ExeState exestate;
+        if (ver > 1)
+            exestate.min_time = Seq::Zynq::PulseTime::Min2;
+        exestate.run(*this, code, code_len, ver);
+    }
+}
+
+}
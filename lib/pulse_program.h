@@ -0,0 +1,189 @@
+/*************************************************************************
+ *   Copyright (c) 2018 - 2018 Yichao Yu <yyc1992@gmail.com>             *
+ *                                                                       *
+ *   This library is free software; you can redistribute it and/or       *
+ *   modify it under the terms of the GNU Lesser General Public          *
+ *   License as published by the Free Software Foundation; either        *
+ *   version 3.0 of the License, or (at your option) any later version.  *
+ *                                                                       *
+ *   This library is distributed in the hope that it will be useful,     *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU    *
+ *   Lesser General Public License for more details.                     *
+ *                                                                       *
+ *   You should have received a copy of the GNU Lesser General Public    *
+ *   License along with this library. If not,                            *
+ *   see <http://www.gnu.org/licenses/>.                                 *
+ *************************************************************************/
+
+#ifndef LIBMOLECUBE_PULSE_PROGRAM_H
+#define LIBMOLECUBE_PULSE_PROGRAM_H
+
+#include <nacs-utils/utils.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+namespace Molecube {
+
+using namespace NaCs;
+
+/**
+ * A sequence (bytecode or cmdlist) decoded into a flat array of operations.
+ *
+ * The decoding is done in the frontend thread when the sequence is submitted
+ * so that the controller thread only need to walk through the array.
+ *
+ * The operations are recorded at the level of the runner interface
+ * (i.e. the same functions `ExeState::run` calls) rather than the final pulses
+ * since the pulses also depend on the state at the time the sequence runs
+ * (current TTL values, DDS overrides and phases).
+ */
+class PulseProgram {
+public:
+    enum OP : uint8_t {
+        TTL,
+        TTL1,
+        DDSFreq,
+        DDSAmp,
+        DDSPhase,
+        DDSDetPhase,
+        DAC,
+        Clock,
+        Wait,
+        WaitTrigger,
+    };
+    struct Inst {
+        OP op;
+        // Channel or bank number
+        uint8_t chn;
+        // TTL1 value or the trigger edge.
+        uint8_t flag;
+        uint32_t val;
+        // Time or timeout
+        uint64_t t;
+    };
+    static_assert(sizeof(Inst) == 16);
+
+    /**
+     * Decode the sequence. The result replaces the current content.
+     *
+     * Throws the error from the decoder if the sequence is invalid,
+     * in which case the part decoded before the error is kept.
+     */
+    void decode(bool is_cmd, uint32_t ver, const uint8_t *code, size_t code_len);
+    const std::vector<Inst> &insts() const
+    {
+        return m_insts;
+    }
+
+    /**
+     * Run the program on the `runner` starting from the `start`th instruction.
+     * The `runner` should provide the same interface as the runner for `ExeState::run`
+     * and an `interrupted()` function, which is checked after each instruction
+     * since any instruction with a long enough time may process commands in the runner.
+     *
+     * Returns the index of the next instruction to run, which is the number of
+     * instructions unless the run is interrupted.
+     */
+    template<typename Runner>
+    size_t run(Runner &&runner, size_t start=0) const
+    {
+        auto ninsts = m_insts.size();
+        for (size_t i = start; i < ninsts; i++) {
+            auto &inst = m_insts[i];
+            switch (inst.op) {
+            case TTL:
+                runner.ttl(inst.val, inst.t, inst.chn);
+                break;
+            case TTL1:
+                runner.ttl1(inst.chn, inst.flag, inst.t);
+                break;
+            case DDSFreq:
+                runner.dds_freq(inst.chn, inst.val);
+                break;
+            case DDSAmp:
+                runner.dds_amp(inst.chn, uint16_t(inst.val));
+                break;
+            case DDSPhase:
+                runner.dds_phase(inst.chn, uint16_t(inst.val));
+                break;
+            case DDSDetPhase:
+                runner.dds_detphase(inst.chn, uint16_t(inst.val));
+                break;
+            case DAC:
+                runner.dac(inst.chn, uint16_t(inst.val));
+                break;
+            case Clock:
+                runner.clock(uint8_t(inst.val));
+                break;
+            case Wait:
+                runner.wait(inst.t);
+                break;
+            case WaitTrigger:
+                runner.wait_trigger(inst.chn, inst.flag, uint32_t(inst.t));
+                break;
+            }
+            if (runner.interrupted()) {
+                return i + 1;
+            }
+        }
+        return ninsts;
+    }
+
+    // Runner interface for `ExeState::run`.
+    void ttl1(int chn, bool val, uint64_t t)
+    {
+        m_insts.push_back(Inst{TTL1, uint8_t(chn), uint8_t(val), 0, t});
+    }
+    void ttl(uint32_t ttl, uint64_t t, int bank)
+    {
+        m_insts.push_back(Inst{TTL, uint8_t(bank), 0, ttl, t});
+    }
+    void dds_freq(uint8_t chn, uint32_t freq)
+    {
+        m_insts.push_back(Inst{DDSFreq, chn, 0, freq, 0});
+    }
+    void dds_amp(uint8_t chn, uint16_t amp)
+    {
+        m_insts.push_back(Inst{DDSAmp, chn, 0, amp, 0});
+    }
+    void dds_phase(uint8_t chn, uint16_t phase)
+    {
+        m_insts.push_back(Inst{DDSPhase, chn, 0, phase, 0});
+    }
+    void dds_detphase(uint8_t chn, uint16_t detphase)
+    {
+        m_insts.push_back(Inst{DDSDetPhase, chn, 0, detphase, 0});
+    }
+    void dac(uint8_t chn, uint16_t V)
+    {
+        m_insts.push_back(Inst{DAC, chn, 0, V, 0});
+    }
+    void clock(uint8_t period)
+    {
+        m_insts.push_back(Inst{Clock, 0, 0, period, 0});
+    }
+    void wait(uint64_t t)
+    {
+        // Merge consecutive waits so that the runner sees fewer and longer waits.
+        if (!m_insts.empty() && m_insts.back().op == Wait) {
+            m_insts.back().t += t;
+            return;
+        }
+        m_insts.push_back(Inst{Wait, 0, 0, 0, t});
+    }
+    void wait_trigger(uint8_t chn, bool trig_raise, uint32_t timeout)
+    {
+        m_insts.push_back(Inst{WaitTrigger, chn, uint8_t(trig_raise), 0, timeout});
+    }
+
+private:
+    std::vector<Inst> m_insts;
+};
+
+}
+
+#endif
@@ -35,7 +35,7 @@ using namespace NaCs;
 /**
  * This class contains the stateless functions to communicate with the FPGA
  */
-class Pulser {
+class Pulser : public PulseEncoder<Pulser> {
     Pulser(const Pulser&) = delete;
     void operator=(const Pulser&) = delete;
     struct Bits {
@@ -47,15 +47,8 @@ class Pulser {
             // Register 3
             Hold = 1 << 7,
             Init = 1 << 8,
-            // Control
-            TTL = 0x00000000,
-            DDS = 0x10000000,
-            Wait = 0x20000000,
-            ClearErr = 0x30000000,
-            LoopBack = 0x40000000,
-            ClockOut = 0x50000000,
-            SPI = 0x60000000,
-            TimeCheck = 0x8000000,
+            // DMA status
+            DMABusy = 0x1,
         };
     };
     inline uint32_t pop_result() const
@@ -67,19 +60,6 @@ class Pulser {
         return (read(2) & Bits::NumRes) >> 4;
     }
 
-    // Internal pulses
-    template<bool checked>
-    inline void spi(uint8_t clk_div, uint8_t spi_id, uint32_t data)
-    {
-        uint32_t opcode = ((uint32_t(spi_id & 3) << 11) | clk_div);
-        pulse<checked>(opcode | Bits::SPI, data);
-    }
-    template<bool checked>
-    inline void dds(uint32_t ctrl, uint32_t op)
-    {
-        pulse<checked>(Bits::DDS | ctrl, op);
-    }
-
 public:
     // Read and write pulse controller registers.
     inline uint32_t read(uint32_t reg) const
@@ -94,37 +74,13 @@ public:
     inline void pulse(uint32_t ctrl, uint32_t op)
     {
         if (checked)
-            ctrl = ctrl | Bits::TimeCheck;
+            ctrl = ctrl | PulseCtrl::TimeCheck;
         write(31, op);
         write(31, ctrl);
     }
-    static constexpr uint32_t max_wait_t = (1 << 24) - 1;
-    // Public functions that are not exposed by the dummy pulser.
-    // set bytes at addr + 1 and addr
-    template<bool checked>
-    inline void dds_set_2bytes(int i, uint32_t addr, uint32_t data)
-    {
-        // put addr in bits 15...9 (maps to DDS opcode_reg[14:9])?
-        // put data in bits 15...0 (maps to DDS operand_reg[15:0])?
-        dds<checked>(0x2 | (i << 4) | (((addr + 1) & 0x7f) << 9), data & 0xffff);
-    }
-    // set bytes addr + 3 ... addr
-    template<bool checked>
-    inline void dds_set_4bytes(int i, uint32_t addr, uint32_t data)
-    {
-        // put addr in bits 15...9 (maps to DDS opcode_reg[14:9])?
-        dds<checked>(0xf | (i << 4) | (((addr + 1) & 0x7f) << 9), data);
-    }
-    template<bool checked>
-    inline void dds_get_2bytes(int i, uint32_t addr)
-    {
-        dds<checked>(0x3 | (i << 4) | ((addr + 1) << 9), 0);
-    }
-    template<bool checked>
-    inline void dds_get_4bytes(int i, uint32_t addr)
-    {
-        dds<checked>(0xe | (i << 4) | ((addr + 1) << 9), 0);
-    }
+    // The pulses are inherited from `PulseEncoder`.
+    // `dds_set_2bytes`, `dds_set_4bytes`, `dds_get_2bytes` and `dds_get_4bytes`
+    // are not exposed by the dummy pulser.
 
     // Read
     inline uint32_t ttl_himask(int bank) const
@@ -182,6 +138,16 @@ public:
     {
         return read(0x59);
     }
+    // Whether the DMA engine still has blocks to fetch.
+    inline bool dma_busy() const
+    {
+        return dma_status() & Bits::DMABusy;
+    }
+    // Number of blocks fetched since the last `first` block was queued (wraps around).
+    inline uint16_t dma_blocks_done() const
+    {
+        return uint16_t(dma_status() >> 16);
+    }
 
     // Write
     // TTL functions: pulse_io = (ttl_out | high_mask) & (~low_mask);
@@ -245,8 +211,13 @@ public:
         write(0x53, dds_addr | (uint32_t(dds_id) << 7));
         return (uint16_t)read(0x53);
     }
+    // Queue `blocks` blocks (`DMA_BLOCK_SIZE` each) starting at the physical address `addr`.
+    // `addr` must be aligned to `DMA_BLOCK_SIZE`, which also limits `blocks` to
+    // `DMA_BLOCK_SIZE / 2 - 1`. `first` marks the beginning of a new stream.
     inline void start_dma(uintptr_t addr, uint16_t blocks, bool first)
     {
+        assert((addr & (DMA_BLOCK_SIZE - 1)) == 0);
+        assert(blocks < DMA_BLOCK_SIZE / 2);
         write(0x58, addr | (blocks << 1) | int(first));
     }
     inline void set_dma_control(uint32_t ctrl)
@@ -254,83 +225,10 @@ public:
         write(0x59, ctrl);
     }
 
-    // Pulses
-    template<bool checked>
-    inline void ttl(uint32_t ttl, uint32_t t, int bank)
-    {
-        assert(t <= max_wait_t);
-        assert(bank >= 0 && bank < NUM_TTL_BANKS);
-        pulse<checked>(Bits::TTL | t | (uint32_t(bank) << 24), ttl);
-    }
-    template<bool checked>
-    inline void clock(uint8_t div)
-    {
-        pulse<checked>(Bits::ClockOut, div & 0xff);
-    }
-    template<bool checked>
-    inline void dac(uint8_t dac, uint16_t V)
-    {
-        spi<checked>(0, 0, ((dac & 3) << 16) | V);
-    }
-    template<bool checked>
-    inline void wait(uint32_t t)
-    {
-        assert(t <= max_wait_t);
-        pulse<checked>(Bits::Wait | t, 0);
-    }
-    template<bool checked>
-    inline void wait_trigger(uint8_t chn, bool trig_raise, uint32_t timeout)
-    {
-        assert(timeout <= max_wait_t);
-        uint32_t trig_type = trig_raise ? 1 : 2;
-        pulse<checked>(Bits::Wait | timeout, (uint32_t(chn) << 20) | (trig_type << 28));
-    }
     // clear timing check (clear failures)
     inline void clear_error()
     {
-        pulse<false>(Bits::ClearErr, 0);
-    }
-    template<bool checked>
-    inline void dds_set_freq(int i, uint32_t ftw)
-    {
-        dds<checked>(i << 4, ftw);
-    }
-    template<bool checked>
-    inline void dds_set_amp(int i, uint16_t amp)
-    {
-        dds_set_2bytes<checked>(i, 0x32, amp);
-    }
-    template<bool checked>
-    inline void dds_set_phase(int i, uint16_t phase)
-    {
-        dds_set_2bytes<checked>(i, 0x30, phase);
-    }
-    template<bool checked>
-    inline void dds_reset(int i)
-    {
-        dds<checked>(0x4 | (i << 4), 0);
-    }
-
-    // Pulses with results
-    template<bool checked>
-    inline void loopback(uint32_t data)
-    {
-        pulse<checked>(Bits::LoopBack, data);
-    }
-    template<bool checked>
-    inline void dds_get_phase(int i)
-    {
-        dds_get_2bytes<checked>(i, 0x30);
-    }
-    template<bool checked>
-    inline void dds_get_amp(int i)
-    {
-        dds_get_2bytes<checked>(i, 0x32);
-    }
-    template<bool checked>
-    inline void dds_get_freq(int i)
-    {
-        dds_get_4bytes<checked>(i, 0x2c);
+        pulse<false>(PulseCtrl::ClearErr, 0);
     }
 
     // Debug registers
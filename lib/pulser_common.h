@@ -19,6 +19,7 @@
 #ifndef LIBMOLECUBE_PULSER_COMMON_H
 #define LIBMOLECUBE_PULSER_COMMON_H
 
+#include <assert.h>
 #include <stdint.h>
 
 #include <string>
@@ -48,6 +49,161 @@ static inline std::string to_string(const pulser_version_t &ver)
     return std::to_string(ver.major) + "." + std::to_string(ver.minor);
 }
 
+// The FPGA fetches DMA buffers in blocks of this size.
+static constexpr uint32_t DMA_BLOCK_SIZE = 4096;
+// Each pulse takes two 32bits words in the DMA buffer.
+static constexpr uint32_t DMA_BLOCK_PULSES = DMA_BLOCK_SIZE / 8;
+
+// Bits in the control word of a pulse.
+struct PulseCtrl {
+    enum : uint32_t {
+        TTL = 0x00000000,
+        DDS = 0x10000000,
+        Wait = 0x20000000,
+        ClearErr = 0x30000000,
+        LoopBack = 0x40000000,
+        ClockOut = 0x50000000,
+        SPI = 0x60000000,
+        TypeMask = 0xf0000000,
+        TimeCheck = 0x8000000,
+    };
+};
+
+/**
+ * Encoding of the pulses for the FPGA.
+ *
+ * Each pulse is a pair of 32bits words `[op][ctrl]`.
+ * `Out` should implement `template<bool checked> void pulse(uint32_t ctrl, uint32_t op)`
+ * to deliver the pulse, either by writing to the registers (`Pulser`)
+ * or by appending to a DMA buffer (`DMAStream`).
+ */
+template<typename Out>
+class PulseEncoder {
+public:
+    static constexpr uint32_t max_wait_t = (1 << 24) - 1;
+
+    // set bytes at addr + 1 and addr
+    template<bool checked>
+    inline void dds_set_2bytes(int i, uint32_t addr, uint32_t data)
+    {
+        // put addr in bits 15...9 (maps to DDS opcode_reg[14:9])?
+        // put data in bits 15...0 (maps to DDS operand_reg[15:0])?
+        dds<checked>(0x2 | (i << 4) | (((addr + 1) & 0x7f) << 9), data & 0xffff);
+    }
+    // set bytes addr + 3 ... addr
+    template<bool checked>
+    inline void dds_set_4bytes(int i, uint32_t addr, uint32_t data)
+    {
+        // put addr in bits 15...9 (maps to DDS opcode_reg[14:9])?
+        dds<checked>(0xf | (i << 4) | (((addr + 1) & 0x7f) << 9), data);
+    }
+    template<bool checked>
+    inline void dds_get_2bytes(int i, uint32_t addr)
+    {
+        dds<checked>(0x3 | (i << 4) | ((addr + 1) << 9), 0);
+    }
+    template<bool checked>
+    inline void dds_get_4bytes(int i, uint32_t addr)
+    {
+        dds<checked>(0xe | (i << 4) | ((addr + 1) << 9), 0);
+    }
+
+    // Pulses
+    template<bool checked>
+    inline void ttl(uint32_t ttl, uint32_t t, int bank)
+    {
+        assert(t <= max_wait_t);
+        assert(bank >= 0 && bank < NUM_TTL_BANKS);
+        out().template pulse<checked>(PulseCtrl::TTL | t | (uint32_t(bank) << 24), ttl);
+    }
+    template<bool checked>
+    inline void clock(uint8_t div)
+    {
+        out().template pulse<checked>(PulseCtrl::ClockOut, div & 0xff);
+    }
+    template<bool checked>
+    inline void dac(uint8_t dac, uint16_t V)
+    {
+        spi<checked>(0, 0, ((dac & 3) << 16) | V);
+    }
+    template<bool checked>
+    inline void wait(uint32_t t)
+    {
+        assert(t <= max_wait_t);
+        out().template pulse<checked>(PulseCtrl::Wait | t, 0);
+    }
+    template<bool checked>
+    inline void wait_trigger(uint8_t chn, bool trig_raise, uint32_t timeout)
+    {
+        assert(timeout <= max_wait_t);
+        uint32_t trig_type = trig_raise ? 1 : 2;
+        out().template pulse<checked>(PulseCtrl::Wait | timeout,
+                                      (uint32_t(chn) << 20) | (trig_type << 28));
+    }
+    template<bool checked>
+    inline void dds_set_freq(int i, uint32_t ftw)
+    {
+        dds<checked>(i << 4, ftw);
+    }
+    template<bool checked>
+    inline void dds_set_amp(int i, uint16_t amp)
+    {
+        dds_set_2bytes<checked>(i, 0x32, amp);
+    }
+    template<bool checked>
+    inline void dds_set_phase(int i, uint16_t phase)
+    {
+        dds_set_2bytes<checked>(i, 0x30, phase);
+    }
+    template<bool checked>
+    inline void dds_reset(int i)
+    {
+        dds<checked>(0x4 | (i << 4), 0);
+    }
+
+    // Pulses with results
+    template<bool checked>
+    inline void loopback(uint32_t data)
+    {
+        out().template pulse<checked>(PulseCtrl::LoopBack, data);
+    }
+    template<bool checked>
+    inline void dds_get_phase(int i)
+    {
+        dds_get_2bytes<checked>(i, 0x30);
+    }
+    template<bool checked>
+    inline void dds_get_amp(int i)
+    {
+        dds_get_2bytes<checked>(i, 0x32);
+    }
+    template<bool checked>
+    inline void dds_get_freq(int i)
+    {
+        dds_get_4bytes<checked>(i, 0x2c);
+    }
+
+protected:
+    // Internal pulses
+    template<bool checked>
+    inline void spi(uint8_t clk_div, uint8_t spi_id, uint32_t data)
+    {
+        uint32_t opcode = ((uint32_t(spi_id & 3) << 11) | clk_div);
+        out().template pulse<checked>(opcode | PulseCtrl::SPI, data);
+    }
+    template<bool checked>
+    inline void dds(uint32_t ctrl, uint32_t op)
+    {
+        out().template pulse<checked>(PulseCtrl::DDS | ctrl, op);
+    }
+
+private:
+    Out &out()
+    {
+        return *static_cast<Out*>(this);
+    }
+};
+
 }
 
 #endif
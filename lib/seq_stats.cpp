@@ -0,0 +1,58 @@
+/*************************************************************************
+ *   Copyright (c) 2018 - 2018 Yichao Yu <yyc1992@gmail.com>             *
+ *                                                                       *
+ *   This library is free software; you can redistribute it and/or       *
+ *   modify it under the terms of the GNU Lesser General Public          *
+ *   License as published by the Free Software Foundation; either        *
+ *   version 3.0 of the License, or (at your option) any later version.  *
+ *                                                                       *
+ *   This library is distributed in the hope that it will be useful,     *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU    *
+ *   Lesser General Public License for more details.                     *
+ *                                                                       *
+ *   You should have received a copy of the GNU Lesser General Public    *
+ *   License along with this library. If not,                            *
+ *   see <http://www.gnu.org/licenses/>.                                 *
+ *************************************************************************/
+
+#include "seq_stats.h"
+
+namespace Molecube {
+
+void SeqStats::add(uint64_t id, bool is_cmd, bool cancelled, const SeqTimes &times)
+{
+    auto &rec = m_ring[m_count % ring_size];
+    m_count++;
+    rec.id = id;
+    rec.npulses = times.npulses;
+    rec.flags = 0;
+    if (is_cmd)
+        rec.flags |= IsCmd;
+    if (cancelled)
+        rec.flags |= Cancelled;
+    if (!times.timing_ok)
+        rec.flags |= TimingFailure;
+    // Skipped stages take no time.
+    uint64_t prev = times.queued;
+    auto stage = [&] (uint64_t t) -> uint64_t {
+        if (!t || t < prev)
+            return 0;
+        auto d = t - prev;
+        prev = t;
+        return d;
+    };
+    rec.durations[Queue] = stage(times.start);
+    rec.durations[Preamble] = stage(times.emit);
+    rec.durations[Release] = stage(times.release);
+    rec.durations[Flush] = stage(times.flush);
+    rec.durations[End] = stage(times.end);
+    rec.durations[Total] = prev - times.queued;
+    if (cancelled)
+        return;
+    for (int i = 0; i < NStages; i++) {
+        m_hists[i].add(rec.durations[i]);
+    }
+}
+
+}
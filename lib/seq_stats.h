@@ -0,0 +1,163 @@
+/*************************************************************************
+ *   Copyright (c) 2018 - 2018 Yichao Yu <yyc1992@gmail.com>             *
+ *                                                                       *
+ *   This library is free software; you can redistribute it and/or       *
+ *   modify it under the terms of the GNU Lesser General Public          *
+ *   License as published by the Free Software Foundation; either        *
+ *   version 3.0 of the License, or (at your option) any later version.  *
+ *                                                                       *
+ *   This library is distributed in the hope that it will be useful,     *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU    *
+ *   Lesser General Public License for more details.                     *
+ *                                                                       *
+ *   You should have received a copy of the GNU Lesser General Public    *
+ *   License along with this library. If not,                            *
+ *   see <http://www.gnu.org/licenses/>.                                 *
+ *************************************************************************/
+
+#ifndef LIBMOLECUBE_SEQ_STATS_H
+#define LIBMOLECUBE_SEQ_STATS_H
+
+#include <nacs-utils/utils.h>
+
+#include <array>
+#include <stdint.h>
+
+namespace Molecube {
+
+using namespace NaCs;
+
+/**
+ * Time stamps (from `getTime()`) of the stages of a sequence.
+ * `queued` is set by the frontend and the rest by the backend.
+ * A stage that is skipped (e.g. the sequence is cancelled) is left as `0`.
+ * The backend must finish writing them before the (release) store of
+ * the final state of the sequence, which the frontend waits for before reading them.
+ */
+struct SeqTimes {
+    // Submitted to the backend.
+    uint64_t queued = 0;
+    // Picked up by the backend.
+    uint64_t start = 0;
+    // Started sending the pulses (after the preamble).
+    uint64_t emit = 0;
+    // The hold on the FPGA is released.
+    uint64_t release = 0;
+    // All the pulses are sent.
+    uint64_t flush = 0;
+    // The end of the sequence is read back.
+    uint64_t end = 0;
+    uint32_t npulses = 0;
+    bool timing_ok = true;
+};
+
+/**
+ * Log-linear histogram of durations in ns, similar to HDR histogram.
+ * Each power of 2 is divided into `nsub` buckets
+ * so the relative error of each bucket is at most `1 / nsub`.
+ */
+class LatencyHistogram {
+public:
+    static constexpr int sub_bits = 4;
+    static constexpr int nsub = 1 << sub_bits;
+    static constexpr int nbuckets = (64 - sub_bits + 1) * nsub;
+
+    static int bucket(uint64_t v)
+    {
+        if (v < nsub)
+            return int(v);
+        int e = 63 - __builtin_clzll(v);
+        return (e - sub_bits + 1) * nsub + int((v >> (e - sub_bits)) & (nsub - 1));
+    }
+    // The smallest value in the bucket.
+    static uint64_t lower_bound(int b)
+    {
+        if (b < nsub)
+            return uint64_t(b);
+        int e = b / nsub + sub_bits - 1;
+        return (uint64_t(nsub) | uint64_t(b % nsub)) << (e - sub_bits);
+    }
+
+    void add(uint64_t v)
+    {
+        m_counts[bucket(v)]++;
+        m_total++;
+    }
+    uint32_t count(int b) const
+    {
+        return m_counts[b];
+    }
+    uint64_t total() const
+    {
+        return m_total;
+    }
+
+private:
+    std::array<uint32_t,nbuckets> m_counts{};
+    uint64_t m_total = 0;
+};
+
+/**
+ * Statistics of the finished sequences.
+ *
+ * The most recent `ring_size` sequences are kept in a ring
+ * and the duration of each stage of all the successful sequences are
+ * accumulated in the histograms.
+ */
+class SeqStats {
+public:
+    static constexpr uint32_t ring_size = 256;
+    enum Stage {
+        // From submission to being picked up by the backend.
+        Queue,
+        // Waiting for the previous sequence and setting up the FPGA.
+        Preamble,
+        // From the first pulse to releasing the hold.
+        Release,
+        // From releasing the hold to sending the last pulse.
+        Flush,
+        // From sending the last pulse to the end of the sequence.
+        End,
+        // From submission to the end of the sequence.
+        Total,
+        NStages
+    };
+    enum Flags : uint32_t {
+        IsCmd = 1 << 0,
+        Cancelled = 1 << 1,
+        TimingFailure = 1 << 2,
+    };
+    struct Record {
+        uint64_t id;
+        uint32_t npulses;
+        uint32_t flags;
+        uint64_t durations[NStages];
+    };
+
+    void add(uint64_t id, bool is_cmd, bool cancelled, const SeqTimes &times);
+
+    // Number of records in the ring.
+    uint32_t size() const
+    {
+        return m_count < ring_size ? uint32_t(m_count) : ring_size;
+    }
+    // The `i`th record in the ring, oldest first.
+    const Record &get(uint32_t i) const
+    {
+        return m_ring[(m_count - size() + i) % ring_size];
+    }
+    const LatencyHistogram &histogram(Stage stage) const
+    {
+        return m_hists[stage];
+    }
+
+private:
+    std::array<Record,ring_size> m_ring;
+    uint64_t m_count = 0;
+    LatencyHistogram m_hists[NStages];
+};
+
+}
+
+#endif
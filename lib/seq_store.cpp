@@ -0,0 +1,73 @@
+/*************************************************************************
+ *   Copyright (c) 2018 - 2018 Yichao Yu <yyc1992@gmail.com>             *
+ *                                                                       *
+ *   This library is free software; you can redistribute it and/or       *
+ *   modify it under the terms of the GNU Lesser General Public          *
+ *   License as published by the Free Software Foundation; either        *
+ *   version 3.0 of the License, or (at your option) any later version.  *
+ *                                                                       *
+ *   This library is distributed in the hope that it will be useful,     *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU    *
+ *   Lesser General Public License for more details.                     *
+ *                                                                       *
+ *   You should have received a copy of the GNU Lesser General Public    *
+ *   License along with this library. If not,                            *
+ *   see <http://www.gnu.org/licenses/>.                                 *
+ *************************************************************************/
+
+#include "seq_store.h"
+
+#include <nacs-utils/log.h>
+
+namespace Molecube {
+
+auto SeqStore::hash(uint32_t ver, const void *data, size_t sz) -> Hash
+{
+    SHA256 h;
+    h.update(&ver, 4);
+    h.update(data, sz);
+    return h.final();
+}
+
+auto SeqStore::add(const Hash &hash, uint32_t ver,
+                   zmq::message_t &msg) -> std::shared_ptr<const Entry>
+{
+    if (auto entry = get(hash))
+        return entry;
+    auto entry = std::make_shared<Entry>();
+    entry->ver = ver;
+#if CPPZMQ_VERSION >= 40301
+    entry->msg.move(msg);
+#else
+    entry->msg.move(&msg);
+#endif
+    m_size += entry->msg.size();
+    m_lru.emplace_front(hash, entry);
+    m_index.emplace(hash, m_lru.begin());
+    evict();
+    return entry;
+}
+
+auto SeqStore::get(const Hash &hash) -> std::shared_ptr<const Entry>
+{
+    auto it = m_index.find(hash);
+    if (it == m_index.end())
+        return nullptr;
+    m_lru.splice(m_lru.begin(), m_lru, it->second);
+    return it->second->second;
+}
+
+void SeqStore::evict()
+{
+    // Always keep the most recent one, even if it's larger than the limit by itself.
+    while (m_size > m_max_size && m_lru.size() > 1) {
+        auto &back = m_lru.back();
+        Log::info("Dropping sequence from store: %zu bytes.\n", back.second->msg.size());
+        m_size -= back.second->msg.size();
+        m_index.erase(back.first);
+        m_lru.pop_back();
+    }
+}
+
+}
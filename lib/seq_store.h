@@ -0,0 +1,88 @@
+/*************************************************************************
+ *   Copyright (c) 2018 - 2018 Yichao Yu <yyc1992@gmail.com>             *
+ *                                                                       *
+ *   This library is free software; you can redistribute it and/or       *
+ *   modify it under the terms of the GNU Lesser General Public          *
+ *   License as published by the Free Software Foundation; either        *
+ *   version 3.0 of the License, or (at your option) any later version.  *
+ *                                                                       *
+ *   This library is distributed in the hope that it will be useful,     *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU    *
+ *   Lesser General Public License for more details.                     *
+ *                                                                       *
+ *   You should have received a copy of the GNU Lesser General Public    *
+ *   License along with this library. If not,                            *
+ *   see <http://www.gnu.org/licenses/>.                                 *
+ *************************************************************************/
+
+#ifndef LIBMOLECUBE_SEQ_STORE_H
+#define LIBMOLECUBE_SEQ_STORE_H
+
+#include "sha256.h"
+
+#include <nacs-utils/zmq_utils.h>
+
+#include <list>
+#include <map>
+#include <memory>
+
+namespace Molecube {
+
+using namespace NaCs;
+
+/**
+ * In memory store of uploaded sequences keyed by the SHA-256 of the content
+ * so that a sequence that is run repeatedly only need to be sent once.
+ *
+ * The least recently used sequences are dropped when the total size
+ * exceeds the limit. Sequences that are still running are kept alive by the
+ * reference held by the request.
+ */
+class SeqStore {
+public:
+    using Hash = SHA256::Digest;
+    struct Entry {
+        uint32_t ver;
+        // Same as the second part of the `run_seq` request.
+        zmq::message_t msg;
+    };
+
+    SeqStore(size_t max_size)
+        : m_max_size(max_size)
+    {
+    }
+
+    // The hash of a sequence is computed on the 4 bytes version (little endian)
+    // followed by the sequence data.
+    static Hash hash(uint32_t ver, const void *data, size_t sz);
+
+    // Add a sequence to the store. The `msg` is moved from.
+    // Returns the entry, which is the existing one if the sequence is already in the store.
+    std::shared_ptr<const Entry> add(const Hash &hash, uint32_t ver, zmq::message_t &msg);
+    // Find a sequence and mark it as recently used. Returns `nullptr` if not found.
+    std::shared_ptr<const Entry> get(const Hash &hash);
+
+    size_t size() const
+    {
+        return m_size;
+    }
+    size_t count() const
+    {
+        return m_index.size();
+    }
+
+private:
+    using LRUList = std::list<std::pair<Hash,std::shared_ptr<const Entry>>>;
+    void evict();
+
+    const size_t m_max_size;
+    size_t m_size = 0;
+    // Most recently used first.
+    LRUList m_lru;
+    std::map<Hash,LRUList::iterator> m_index;
+};
+
+}
+
+#endif
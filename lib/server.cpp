@@ -18,6 +18,8 @@
 
 #include "server.h"
 #include "config.h"
+#include "server_op.h"
+#include "trace.h"
 
 #include <nacs-utils/errors.h>
 #include <nacs-utils/log.h>
@@ -65,6 +67,48 @@ static void free_malloc_msg(void *data, void*)
     free(data);
 }
 
+struct SeqInfo {
+    uint64_t len_ns;
+    std::array<uint32_t,NUM_TTL_BANKS> ttl_mask;
+    uint32_t ttl_banks;
+    const uint8_t *code;
+    size_t code_len;
+};
+
+// Parse the sequence header (length and TTL masks) in the `run_seq` request.
+static bool parse_seq(uint32_t ver, const uint8_t *data, size_t sz, SeqInfo &info)
+{
+    // Not long enough
+    if (sz < 12)
+        return false;
+    memcpy(&info.len_ns, data, 8);
+    data += 8;
+    sz -= 8;
+
+    info.ttl_mask.fill(0);
+    if (ver < 3) {
+        info.ttl_banks = 1;
+        memcpy(&info.ttl_mask, data, 4);
+        data += 4;
+        sz -= 4;
+    }
+    else {
+        memcpy(&info.ttl_banks, data, 4);
+        data += 4;
+        sz -= 4;
+        if (info.ttl_banks == 0 || info.ttl_banks > NUM_TTL_BANKS)
+            return false;
+        if (sz < info.ttl_banks * 4)
+            return false;
+        memcpy(&info.ttl_mask, data, 4 * info.ttl_banks);
+        data += 4 * info.ttl_banks;
+        sz -= 4 * info.ttl_banks;
+    }
+    info.code = data;
+    info.code_len = sz;
+    return true;
+}
+
 }
 
 #define _NACS_EXPORT NACS_EXPORT()
@@ -77,7 +121,53 @@ inline void Server::send_reply(std::vector<zmq::message_t> &addr, zmq::message_t
 
 inline bool Server::recv_more(zmq::message_t &msg)
 {
-    return ZMQ::recv_more(m_zmqsock, msg);
+    return ZMQ::recv_more(*m_reqsock, msg);
+}
+
+inline void Server::send_seq_reply(std::vector<zmq::message_t> &addr, zmq::message_t &msg)
+{
+    ZMQ::send_addr(m_seqsock, addr, m_seq_empty);
+    ZMQ::send(m_seqsock, msg);
+}
+
+inline bool Server::seq_recv_more(zmq::message_t &msg)
+{
+    return ZMQ::recv_more(m_seqsock, msg);
+}
+
+void Server::publish(PubTopic topic, const void *data, size_t sz)
+{
+    if (m_conf.publish.empty())
+        return;
+    static const char *const names[] = {"ttl", "dds", "override_dds", "reset_dds",
+                                        "clock", "seq", "names"};
+    static_assert(sizeof(names) / sizeof(names[0]) == size_t(PubTopic::_Num));
+    auto name = names[int(topic)];
+    zmq::message_t hdr(name, strlen(name));
+    ZMQ::send_more(m_pubsock, hdr);
+    auto cnt = m_pub_cnt[int(topic)]++;
+    zmq::message_t msg(16 + sz);
+    memcpy(msg.data(), &m_id, 8);
+    memcpy((char*)msg.data() + 8, &cnt, 8);
+    if (sz)
+        memcpy((char*)msg.data() + 16, data, sz);
+    ZMQ::send(m_pubsock, msg);
+}
+
+void Server::publish_ttl(uint32_t bank, uint32_t val)
+{
+    std::array<uint32_t,4> res{bank, val, m_ctrl->get_ttl_ovrlo(bank),
+        m_ctrl->get_ttl_ovrhi(bank)};
+    publish(PubTopic::TTL, &res, sizeof(res));
+}
+
+void Server::publish_seq(uint64_t id, uint8_t state)
+{
+    std::array<uint8_t,17> res;
+    memcpy(&res[0], &id, 8);
+    memcpy(&res[8], &m_id, 8);
+    res[16] = state;
+    publish(PubTopic::Seq, &res, sizeof(res));
 }
 
 inline uint64_t Server::get_seq_id(zmq::message_t &msg, size_t suffix)
@@ -202,14 +292,34 @@ _NACS_EXPORT Server::Server(const Config &conf)
       m_id(get_server_id()),
       m_ctrl(CtrlIFace::create(conf.dummy)),
       m_zmqctx(),
-      m_zmqsock(m_zmqctx, ZMQ_ROUTER),
+      m_zmqsock(m_zmqctx, ZMQ_PAIR),
+      m_fwdsock(m_zmqctx, ZMQ_PAIR),
+      m_pubsock(m_zmqctx, ZMQ_PUB),
       m_zmqpoll{{(void*)m_zmqsock, 0, ZMQ_POLLIN, 0},
+                {(void*)m_fwdsock, 0, ZMQ_POLLIN, 0},
                 {nullptr, m_ctrl->backend_fd(), ZMQ_POLLIN, 0}},
+      m_netsock(m_zmqctx, ZMQ_ROUTER),
+      m_iosock(m_zmqctx, ZMQ_PAIR),
+      m_io_seqsock(m_zmqctx, ZMQ_PAIR),
+      m_seqsock(m_zmqctx, ZMQ_PAIR),
+      m_seq_fwdsock(m_zmqctx, ZMQ_PAIR),
+      m_seq_store(conf.seq_store_size),
       m_ttl_names(conf.runtime_dir + "/ttl.yaml"),
       m_dds_names(conf.runtime_dir + "/dds.yaml")
 {
     Log::info("Listening on: `%s`\n", m_conf.listen.c_str());
-    m_zmqsock.bind(m_conf.listen);
+    m_netsock.bind(m_conf.listen);
+    // The inproc endpoint must be bound before connecting.
+    m_iosock.bind("inproc://molecube-io");
+    m_zmqsock.connect("inproc://molecube-io");
+    m_io_seqsock.bind("inproc://molecube-io-seq");
+    m_seqsock.connect("inproc://molecube-io-seq");
+    m_fwdsock.bind("inproc://molecube-seq-fwd");
+    m_seq_fwdsock.connect("inproc://molecube-seq-fwd");
+    if (!m_conf.publish.empty()) {
+        Log::info("Publishing on: `%s`\n", m_conf.publish.c_str());
+        m_pubsock.bind(m_conf.publish);
+    }
     // This will come after we try to use the directory above
     // This shouldn't cause any major issue though since if the directory didn't exist,
     // the file in it won't exist either and the loading will fail no matter what.
@@ -225,29 +335,77 @@ _NACS_EXPORT Server::Server(const Config &conf)
     m_ctrl->set_dds_timing1(m_conf.dds_write_adsu, m_conf.dds_write_wrlow,
                             m_conf.dds_write_adhd, m_conf.dds_write_fuddl,
                             m_conf.dds_write_fudhd);
+    m_ctrl->set_use_dma(m_conf.use_dma);
+    m_ctrl->set_arm_timeout(uint64_t(m_conf.arm_timeout * 1e9));
     run_startup();
 }
 
 _NACS_EXPORT void Server::run()
 {
     m_running.store(true, std::memory_order_relaxed);
+    m_io_thread = std::thread([this] { io_thread(); });
+    m_seq_thread = std::thread([this] { seq_thread(); });
     while (m_running.load(std::memory_order_relaxed)) {
-        auto has_pending = m_ctrl->has_pending();
-        long timeout = 1000;
-        if (has_pending.second) {
-            timeout = 0;
-        }
-        else if (has_pending.first) {
-            timeout = 10;
-        }
+        // The backend signals the event fd for every change
+        // so there's no need to poll it while waiting.
+        long timeout = m_ctrl->has_pending().second ? 0 : 1000;
         zmq::poll(m_zmqpoll, sizeof(m_zmqpoll) / sizeof(zmq::pollitem_t), timeout);
         m_ctrl->run_frontend();
         if (m_zmqpoll[0].revents & ZMQ_POLLIN) {
-            process_zmq();
+            process_zmq(m_zmqsock);
+        }
+        if (m_zmqpoll[1].revents & ZMQ_POLLIN) {
+            process_zmq(m_fwdsock);
+        }
+    }
+    m_io_thread.join();
+    m_seq_thread.join();
+    drop_queued_seqs();
+}
+
+void Server::io_thread()
+{
+    zmq::pollitem_t polls[3] = {{(void*)m_netsock, 0, ZMQ_POLLIN, 0},
+                                {(void*)m_iosock, 0, ZMQ_POLLIN, 0},
+                                {(void*)m_io_seqsock, 0, ZMQ_POLLIN, 0}};
+    while (m_running.load(std::memory_order_relaxed)) {
+        zmq::poll(polls, 3, 1000);
+        if (polls[1].revents & ZMQ_POLLIN) {
+            forward_reply(m_iosock);
+        }
+        if (polls[2].revents & ZMQ_POLLIN) {
+            forward_reply(m_io_seqsock);
+        }
+        if (polls[0].revents & ZMQ_POLLIN) {
+            process_net();
+        }
+    }
+}
+
+void Server::seq_thread()
+{
+    zmq::pollitem_t poll{(void*)m_seqsock, 0, ZMQ_POLLIN, 0};
+    while (m_running.load(std::memory_order_relaxed)) {
+        zmq::poll(&poll, 1, 1000);
+        if (poll.revents & ZMQ_POLLIN) {
+            process_seq_req();
         }
     }
 }
 
+void Server::forward_reply(zmq::socket_t &sock)
+{
+    // All the replies from the frontend are sent with `send_reply`
+    // and the ones from the sequence thread with `send_seq_reply`.
+    auto addr = ZMQ::recv_addr(sock);
+    zmq::message_t msg;
+    if (ZMQ::recv_more(sock, msg)) {
+        ZMQ::send_addr(m_netsock, addr, m_io_empty);
+        ZMQ::send(m_netsock, msg);
+    }
+    ZMQ::readall(sock);
+}
+
 bool Server::process_set_dds(zmq::message_t &msg, bool is_ovr)
 {
     size_t msgsz = msg.size();
@@ -269,147 +427,324 @@ bool Server::process_set_dds(zmq::message_t &msg, bool is_ovr)
             return false;
         }
     }
+    // Only the same channel can be set multiple times if there are more than
+    // 66 entries in which case we can send them in multiple batches.
+    CtrlIFace::DDSSet sets[3 * 22];
+    size_t nsets = 0;
     for (size_t i = 0; i < msgsz; i += 5) {
         auto chn = data[i];
-        auto op = dds_ops[chn >> 6];
-        chn = chn & 0x3f;
         uint32_t val;
         memcpy(&val, &data[i + 1], 4);
-        if (is_ovr) {
-            m_ctrl->set_dds_ovr(op, chn, val);
-        }
-        else {
-            m_ctrl->set_dds(op, chn, val);
+        sets[nsets++] = {dds_ops[chn >> 6], chn & 0x3f, val};
+        if (nsets == 3 * 22 || i + 5 >= msgsz) {
+            m_ctrl->set_dds_batch(sets, nsets, is_ovr);
+            nsets = 0;
         }
     }
     return true;
 }
 
-bool Server::process_run_seq(std::vector<zmq::message_t> &addr, bool is_cmd)
+struct Server::PreparedSeq {
+    bool is_cmd;
+    CtrlIFace::SeqOpts opts;
+    uint32_t ver = 0;
+    Timer timer{};
+    // The sequence data is kept alive by either the message of the request
+    // or the `storage`.
+    zmq::message_t msg{};
+    AnyPtr storage{};
+    // Size of the sequence data (for logging).
+    size_t sz = 0;
+    SeqInfo info{};
+    PulseProgram program{};
+    // The address of the client to reply to.
+    std::vector<zmq::message_t> addr{};
+};
+
+bool Server::recv_seq(uint32_t &ver, zmq::message_t &msg)
 {
-    zmq::message_t msg;
     // No version
-    if (!recv_more(msg) || msg.size() != 4)
+    if (!seq_recv_more(msg) || msg.size() != 4)
         return false;
-    uint32_t ver;
     memcpy(&ver, msg.data(), 4);
     if (ver != 1 && ver != 2 && ver != 3)
         return false;
-    // Not long enough
-    if (!recv_more(msg) || msg.size() < 12)
+    return seq_recv_more(msg);
+}
+
+bool Server::process_run_seq(std::vector<zmq::message_t> &addr, bool is_cmd,
+                             const CtrlIFace::SeqOpts &opts)
+{
+    // Moving a ZMQ message **MAY** copy data and may change the valid address
+    // since for small message the data may be stored inline.
+    // Therefore, receive the message directly into the object
+    // that keeps it alive for the sequence.
+    std::unique_ptr<PreparedSeq> seq(new PreparedSeq{is_cmd, opts});
+    if (!recv_seq(seq->ver, seq->msg))
         return false;
-    auto orig_msg_data = (const uint8_t*)msg.data();
-    auto msg_data = orig_msg_data;
-    auto msg_sz = msg.size();
 
-    Timer timer;
-    Log::info("Running %s: %zu bytes.\n", is_cmd ? "command list" : "sequence", msg_sz);
+    seq->timer.restart();
+    auto data = (const uint8_t*)seq->msg.data();
+    auto sz = seq->msg.size();
+    return prepare_seq(addr, std::move(seq), data, sz);
+}
 
-    uint64_t len_ns;
-    memcpy(&len_ns, msg_data, 8);
-    msg_data += 8;
-    msg_sz -= 8;
+bool Server::process_wait_seq(std::vector<zmq::message_t> &addr, zmq::message_t &msg)
+{
+    if (msg.size() != 17 && msg.size() != 21)
+        return false;
+    auto id = get_seq_id(msg, msg.size() - 16);
+    if (!id)
+        return false;
+    uint8_t what = ((uint8_t*)msg.data())[16];
+    // Reserve what == 0 for sequence start. FIXME: implement waiting for sequence start.
+    what = uint8_t(what - 1);
+    if (what != 0 && what != 1)
+        return false;
+    uint32_t nfinished = 0;
+    if (msg.size() == 21) {
+        // Waiting for a repetition only makes sense for the finish state.
+        if (what != 1)
+            return false;
+        memcpy(&nfinished, (char*)msg.data() + 17, 4);
+    }
+    Log::info("Waiting for sequence %llu\n", (unsigned long long)id);
+    if (m_seq_status.empty() || m_seq_status[0].id > id) {
+        send_reply(addr, ZMQ::bits_msg<uint8_t>(0));
+        return true;
+    }
+    auto status = find_seqstatus(id);
+    if (!status)
+        return false;
+    if ((what == 0 && status->flushed) || (nfinished && status->nfinished >= nfinished)) {
+        send_reply(addr, ZMQ::bits_msg<uint8_t>(0));
+        return true;
+    }
+    status->wait.push_back(SeqStatus::Wait{what, std::move(addr), nfinished});
+    return true;
+}
 
-    std::array<uint32_t,NUM_TTL_BANKS> ttl_mask;
-    uint32_t ttl_banks;
-    ttl_mask.fill(0);
-    if (ver < 3) {
-        ttl_banks = 1;
-        memcpy(&ttl_mask, msg_data, 4);
-        msg_data += 4;
-        msg_sz -= 4;
+bool Server::process_run_seq_repeat(std::vector<zmq::message_t> &addr)
+{
+    zmq::message_t msg;
+    if (!seq_recv_more(msg) || (msg.size() != 4 && msg.size() != 12))
+        return false;
+    CtrlIFace::SeqOpts opts;
+    memcpy(&opts.repeat, msg.data(), 4);
+    if (msg.size() == 12)
+        memcpy(&opts.delay_ns, (char*)msg.data() + 4, 8);
+    if (opts.repeat == 0)
+        return false;
+    Log::info("Repeating sequence %u times (delay: %.3f ms).\n", opts.repeat,
+              double(opts.delay_ns) / 1e6);
+    return process_run_seq(addr, false, opts);
+}
+
+bool Server::process_upload_seq(std::vector<zmq::message_t> &addr)
+{
+    zmq::message_t msg;
+    uint32_t ver;
+    if (!recv_seq(ver, msg))
+        return false;
+    SeqInfo info;
+    if (!parse_seq(ver, (const uint8_t*)msg.data(), msg.size(), info))
+        return false;
+    auto hash = SeqStore::hash(ver, msg.data(), msg.size());
+    Log::info("Uploading sequence: %zu bytes.\n", msg.size());
+    m_seq_store.add(hash, ver, msg);
+    send_seq_reply(addr, ZMQ::bits_msg(hash));
+    return true;
+}
+
+bool Server::process_run_seq_by_hash(std::vector<zmq::message_t> &addr)
+{
+    zmq::message_t msg;
+    SeqStore::Hash hash;
+    if (!seq_recv_more(msg) || msg.size() != hash.size())
+        return false;
+    memcpy(&hash[0], msg.data(), hash.size());
+    auto entry = m_seq_store.get(hash);
+    if (!entry) {
+        Log::info("Sequence not found in store.\n");
+        send_seq_reply(addr, ZMQ::bits_msg<uint8_t>(2));
+        return true;
     }
-    else {
-        memcpy(&ttl_banks, msg_data, 4);
-        msg_data += 4;
-        msg_sz -= 4;
-        if (ttl_banks == 0 || ttl_banks > NUM_TTL_BANKS)
-            return false;
-        if (msg_sz < ttl_banks * 4)
-            return false;
-        memcpy(&ttl_mask, msg_data, 4 * ttl_banks);
-        msg_data += 4 * ttl_banks;
-        msg_sz -= 4 * ttl_banks;
+    auto data = (const uint8_t*)entry->msg.data();
+    auto sz = entry->msg.size();
+    std::unique_ptr<PreparedSeq> seq(new PreparedSeq{false, CtrlIFace::SeqOpts(), entry->ver});
+    // The request keeps a reference so that the sequence stays alive
+    // even if it's evicted from the store while running.
+    seq->storage = std::move(entry);
+    return prepare_seq(addr, std::move(seq), data, sz);
+}
+
+bool Server::seq_queue_full(size_t sz) const
+{
+    auto nseqs = m_ctrl->queued_seqs();
+    // Always accept a sequence when the queue is empty
+    // so that a single large sequence can still run.
+    if (nseqs == 0)
+        return false;
+    if (m_conf.max_queued_seqs && nseqs >= m_conf.max_queued_seqs)
+        return true;
+    if (m_conf.max_queued_bytes && m_ctrl->queued_seq_bytes() + sz > m_conf.max_queued_bytes)
+        return true;
+    return false;
+}
+
+bool Server::prepare_seq(std::vector<zmq::message_t> &addr, std::unique_ptr<PreparedSeq> seq,
+                         const uint8_t *data, size_t sz)
+{
+    auto &info = seq->info;
+    if (!parse_seq(seq->ver, data, sz, info))
+        return false;
+    seq->sz = sz;
+    // Cheap check before spending time on decoding.
+    // The frontend checks again with the size of the decoded program.
+    if (seq_queue_full(info.code_len)) {
+        Log::warn("Sequence queue full (%zu sequences, %zu bytes), rejecting %s: %zu bytes.\n",
+                  m_ctrl->queued_seqs(), m_ctrl->queued_seq_bytes(),
+                  seq->is_cmd ? "command list" : "sequence", sz);
+        send_seq_reply(addr, ZMQ::bits_msg<uint8_t>(3));
+        return true;
     }
+    seq->program = CtrlIFace::decode_code(seq->is_cmd, seq->ver, info.code, info.code_len);
+    // The frontend takes the ownership of the sequence.
+    // The address is passed with the sequence so that the frontend doesn't need to
+    // allocate for it.
+    seq->addr = std::move(addr);
+    ZMQ::send_more(m_seq_fwdsock, m_seq_empty);
+    auto op = ZMQ::bits_msg(ServerOp::QueueSeq);
+    ZMQ::send_more(m_seq_fwdsock, op);
+    auto ptr = ZMQ::bits_msg(seq.release());
+    ZMQ::send(m_seq_fwdsock, ptr);
+    return true;
+}
 
-    struct Notify: CtrlIFace::ReqSeqNotify {
-        void set_id(uint64_t _id) override
-        {
-            id = _id;
-        }
-        void start(uint64_t _id) override
-        {
-            (void)_id;
-            assert(id == _id);
-            Log::info("Start time: %.1f ms\n", (double)timer.elapsed() / 1000000.0);
-        }
-        void flushed(uint64_t _id) override
-        {
-            (void)_id;
-            assert(id == _id);
-            auto status = server.find_seqstatus(id);
-            assert(status);
-            status->flushed = true;
-            for (auto &wait: status->wait) {
-                if (wait.what == 0) {
-                    server.send_reply(wait.addr, ZMQ::bits_msg<uint8_t>(0));
-                }
+struct Server::SeqNotify: CtrlIFace::ReqSeqNotify {
+    void set_id(uint64_t _id) override
+    {
+        id = _id;
+    }
+    void start(uint64_t _id) override
+    {
+        (void)_id;
+        assert(id == _id);
+        Log::info("Start time: %.1f ms\n", (double)timer.elapsed() / 1000000.0);
+        server.publish_seq(id, 0);
+    }
+    void flushed(uint64_t _id) override
+    {
+        (void)_id;
+        assert(id == _id);
+        auto status = server.find_seqstatus(id);
+        assert(status);
+        status->flushed = true;
+        server.publish_seq(id, 1);
+        for (auto &wait: status->wait) {
+            if (wait.what == 0) {
+                server.send_reply(wait.addr, ZMQ::bits_msg<uint8_t>(0));
             }
         }
-        void end(uint64_t _id) override
-        {
-            (void)_id;
-            assert(id == _id);
-            Log::info("Finish time: %.1f ms\n", (double)timer.elapsed() / 1000000.0);
-            finalize(false);
-        }
-        void cancel(uint64_t _id) override
-        {
-            (void)_id;
-            assert(id == _id);
-            finalize(true);
-        }
-        Notify(Server &server, Timer timer)
-            : server(server),
-              timer(std::move(timer))
-        {
+    }
+    void progress(uint64_t _id, uint32_t nfinished) override
+    {
+        (void)_id;
+        assert(id == _id);
+        auto status = server.find_seqstatus(id);
+        assert(status);
+        status->nfinished = nfinished;
+        auto &waits = status->wait;
+        for (size_t i = 0; i < waits.size();) {
+            auto &wait = waits[i];
+            if (wait.what != 1 || !wait.nfinished || wait.nfinished > nfinished) {
+                i++;
+                continue;
+            }
+            server.send_reply(wait.addr, ZMQ::bits_msg<uint8_t>(0));
+            waits.erase(waits.begin() + i);
         }
-        ~Notify() override
-        {
-            finalize(true);
+    }
+    void end(uint64_t _id) override
+    {
+        (void)_id;
+        assert(id == _id);
+        Log::info("Finish time: %.1f ms\n", (double)timer.elapsed() / 1000000.0);
+        server.publish_seq(id, 2);
+        finalize(false);
+    }
+    void cancel(uint64_t _id) override
+    {
+        (void)_id;
+        assert(id == _id);
+        server.publish_seq(id, 3);
+        finalize(true);
+    }
+    SeqNotify(Server &server, Timer timer)
+        : server(server),
+          timer(std::move(timer))
+    {
+    }
+    ~SeqNotify() override
+    {
+        finalize(true);
+    }
+    void finalize(bool cancel)
+    {
+        auto status = server.find_seqstatus(id);
+        if (!status)
+            return;
+        for (auto &wait: status->wait) {
+            if (wait.what == 0 && status->flushed)
+                continue;
+            server.send_reply(wait.addr, ZMQ::bits_msg<uint8_t>(cancel));
         }
-        void finalize(bool cancel)
-        {
-            auto status = server.find_seqstatus(id);
-            if (!status)
-                return;
-            for (auto &wait: status->wait) {
-                if (wait.what == 0 && status->flushed)
-                    continue;
-                server.send_reply(wait.addr, ZMQ::bits_msg<uint8_t>(cancel));
-            }
-            auto idx = status - &server.m_seq_status[0];
-            server.m_seq_status.erase(server.m_seq_status.begin() + idx);
+        auto idx = status - &server.m_seq_status[0];
+        server.m_seq_status.erase(server.m_seq_status.begin() + idx);
+    }
+    // One of these is created for every sequence and is freed by the `CtrlIFace`
+    // (on the frontend thread) so keep the freed ones for reuse.
+    static void *operator new(size_t sz)
+    {
+        assert(sz == sizeof(SeqNotify));
+        if (auto p = free_list) {
+            free_list = *(void**)p;
+            return p;
         }
-        Server &server;
-        Timer timer;
-        uint64_t id = -1;
-    };
+        return ::operator new(sz);
+    }
+    static void operator delete(void *p)
+    {
+        *(void**)p = free_list;
+        free_list = p;
+    }
+    Server &server;
+    Timer timer;
+    uint64_t id = -1;
+    static inline void *free_list = nullptr;
+};
 
-    auto notify = new Notify(*this, std::move(timer));
-    // Moving a ZMQ message **MAY** copy data and may change the valid address
-    // since for small message the data may be stored inline.
-    // Therefore, we need to update the pointer after we move the message...
-    auto offset = msg_data - orig_msg_data;
-    auto new_msg = new zmq::message_t;
-#if CPPZMQ_VERSION >= 40301
-    new_msg->move(msg);
-#else
-    new_msg->move(&msg);
-#endif
-    msg_data = (const uint8_t*)new_msg->data() + offset;
-    auto id = m_ctrl->run_code(is_cmd, ver, len_ns, ttl_mask, msg_data, msg_sz,
-                               std::unique_ptr<CtrlIFace::ReqSeqNotify>(notify), new_msg);
+void Server::queue_seq(std::unique_ptr<PreparedSeq> seq)
+{
+    auto &addr = seq->addr;
+    auto &info = seq->info;
+    auto is_cmd = seq->is_cmd;
+    if (seq_queue_full(CtrlIFace::seq_mem_size(info.code_len, seq->program))) {
+        Log::warn("Sequence queue full (%zu sequences, %zu bytes), rejecting %s: %zu bytes.\n",
+                  m_ctrl->queued_seqs(), m_ctrl->queued_seq_bytes(),
+                  is_cmd ? "command list" : "sequence", seq->sz);
+        send_reply(addr, ZMQ::bits_msg<uint8_t>(3));
+        return;
+    }
+    Log::info("%s %s: %zu bytes.\n", seq->opts.armed ? "Arming" : "Running",
+              is_cmd ? "command list" : "sequence", seq->sz);
+    auto ttl_banks = info.ttl_banks;
+
+    std::unique_ptr<CtrlIFace::ReqSeqNotify> notify(new SeqNotify(*this, std::move(seq->timer)));
+    // The prepared sequence keeps the data alive until the sequence finishes.
+    auto p = seq.release();
+    auto id = m_ctrl->run_code(p->opts, is_cmd, p->ver, info.len_ns, info.ttl_mask, info.code,
+                               info.code_len, std::move(p->program), std::move(notify), p);
     m_seq_status.push_back(SeqStatus{id});
     Log::info("Sequence %llu scheduled.\n", (unsigned long long)id);
     if (is_cmd) {
@@ -421,27 +756,44 @@ bool Server::process_run_seq(std::vector<zmq::message_t> &addr, bool is_cmd)
         send_reply(addr, ZMQ::bits_msg(res));
     }
     else {
-        std::vector<uint8_t> res(16 + 8 * ttl_banks);
+        // Build the reply in place.
+        auto nbanks_sz = 4 * ttl_banks;
+        // The active DDS's may change on the worker thread,
+        // use the same snapshot for the size and the content.
+        auto active = m_ctrl->get_active_dds_mask();
+        zmq::message_t reply(16 + 2 * nbanks_sz + 5 * count_override_dds(active));
+        auto res = (uint8_t*)reply.data();
         memcpy(&res[0], &id, 8);
         memcpy(&res[8], &m_id, 8);
-        get_override_dds([addr{std::move(addr)}, res{std::move(res)}, ttl_banks, this]
-                         (auto dds_res) mutable {
-            res.insert(res.end(), dds_res.begin(), dds_res.end());
-            auto lo_start = &res[16];
-            auto hi_start = &res[16 + 4 * ttl_banks];
-            for (uint32_t bank = 0; bank < ttl_banks; bank++) {
-                auto lo = m_ctrl->get_ttl_ovrlo(bank);
-                auto hi = m_ctrl->get_ttl_ovrhi(bank);
-                memcpy(&lo_start[bank * 4], &lo, 4);
-                memcpy(&hi_start[bank * 4], &hi, 4);
-            }
-            auto sz = res.size();
-            zmq::message_t msg(sz);
-            memcpy(msg.data(), &res[0], sz);
-            send_reply(addr, msg);
-        });
+        auto lo_start = &res[16];
+        auto hi_start = &res[16 + nbanks_sz];
+        for (uint32_t bank = 0; bank < ttl_banks; bank++) {
+            auto lo = m_ctrl->get_ttl_ovrlo(bank);
+            auto hi = m_ctrl->get_ttl_ovrhi(bank);
+            memcpy(&lo_start[bank * 4], &lo, 4);
+            memcpy(&hi_start[bank * 4], &hi, 4);
+        }
+        write_override_dds(&res[16 + 2 * nbanks_sz], active);
+        send_reply(addr, reply);
+    }
+}
+
+void Server::drop_queued_seqs()
+{
+    // Free the decoded sequences that the frontend didn't pick up before exiting.
+    zmq::pollitem_t poll{(void*)m_fwdsock, 0, ZMQ_POLLIN, 0};
+    while (zmq::poll(&poll, 1, 0) > 0 && (poll.revents & ZMQ_POLLIN)) {
+        ZMQ::recv_addr(m_fwdsock);
+        zmq::message_t msg;
+        if (ZMQ::recv_more(m_fwdsock, msg) && msg.size() == 1 &&
+            ServerOp(*(const uint8_t*)msg.data()) == ServerOp::QueueSeq &&
+            ZMQ::recv_more(m_fwdsock, msg) && msg.size() == sizeof(PreparedSeq*)) {
+            PreparedSeq *seq;
+            memcpy(&seq, msg.data(), sizeof(seq));
+            delete seq;
+        }
+        ZMQ::readall(m_fwdsock);
     }
-    return true;
 }
 
 auto Server::find_seqstatus(uint64_t id) -> SeqStatus*
@@ -483,6 +835,10 @@ bool Server::process_set_names(zmq::message_t &msg, NamesConfig &names)
     if (has_set) {
         names.save();
         m_name_id++;
+        std::array<uint8_t,9> res;
+        memcpy(&res[0], &m_name_id, 8);
+        res[8] = &names == &m_dds_names;
+        publish(PubTopic::Names, &res, sizeof(res));
     }
 
     return has_set;
@@ -505,6 +861,57 @@ void Server::process_get_names(std::vector<zmq::message_t> &addr, NamesConfig &n
     send_reply(addr, zmq::message_t(ptr, msgsz, free_malloc_msg));
 }
 
+void Server::process_get_seq_stats(std::vector<zmq::message_t> &addr)
+{
+    malloc_ostream ostm;
+    auto write = [&] (auto v) {
+        ostm.write((const char*)&v, sizeof(v));
+    };
+    auto &stats = m_ctrl->get_seq_stats();
+    uint32_t nrecords = stats.size();
+    write(nrecords);
+    for (uint32_t i = 0; i < nrecords; i++) {
+        auto &rec = stats.get(i);
+        write(rec.id);
+        write(rec.npulses);
+        write(rec.flags);
+        for (auto d: rec.durations) {
+            write(d);
+        }
+    }
+    for (int stage = 0; stage < SeqStats::NStages; stage++) {
+        auto &hist = stats.histogram(SeqStats::Stage(stage));
+        write(hist.total());
+        uint32_t nbuckets = 0;
+        for (int b = 0; b < LatencyHistogram::nbuckets; b++)
+            nbuckets += hist.count(b) != 0;
+        write(nbuckets);
+        for (int b = 0; b < LatencyHistogram::nbuckets; b++) {
+            if (auto cnt = hist.count(b)) {
+                write(LatencyHistogram::lower_bound(b));
+                write(cnt);
+            }
+        }
+    }
+    size_t msgsz;
+    auto ptr = ostm.get_buf(msgsz);
+    send_reply(addr, zmq::message_t(ptr, msgsz, free_malloc_msg));
+}
+
+void Server::process_get_queue_info(std::vector<zmq::message_t> &addr)
+{
+    std::array<uint8_t,24> res;
+    uint32_t nseqs = uint32_t(m_ctrl->queued_seqs());
+    uint64_t nbytes = m_ctrl->queued_seq_bytes();
+    uint32_t max_nseqs = m_conf.max_queued_seqs;
+    uint64_t max_nbytes = m_conf.max_queued_bytes;
+    memcpy(&res[0], &nseqs, 4);
+    memcpy(&res[4], &nbytes, 8);
+    memcpy(&res[12], &max_nseqs, 4);
+    memcpy(&res[16], &max_nbytes, 8);
+    send_reply(addr, ZMQ::bits_msg(res));
+}
+
 void Server::process_set_startup(std::vector<zmq::message_t> &addr, zmq::message_t &msg)
 {
     Log::info("Setting startup file.\n");
@@ -512,7 +919,7 @@ void Server::process_set_startup(std::vector<zmq::message_t> &addr, zmq::message
     size_t size = strnlen(data, msg.size());
     if (size == msg.size()) {
         Log::error("Startup sequence not NUL terminated.\n");
-        send_reply(addr, ZMQ::bits_msg<uint8_t>(1));
+        send_seq_reply(addr, ZMQ::bits_msg<uint8_t>(1));
         return;
     }
     const_istream istm(data, data + size);
@@ -541,7 +948,7 @@ void Server::process_set_startup(std::vector<zmq::message_t> &addr, zmq::message
         std::array<int,3> cols;
         cols[0] = err.columns(&cols[1], &cols[2]);
         memcpy(zmsgdata, &cols[0], 12);
-        send_reply(addr, zmsg);
+        send_seq_reply(addr, zmsg);
         return;
     }
     auto ttmpname = m_conf.runtime_dir + "/startup.cmdlist.tmp";
@@ -561,7 +968,7 @@ void Server::process_set_startup(std::vector<zmq::message_t> &addr, zmq::message
     obstm.write(bstr.data(), bstr.size());
     if (!obstm.good() || !otstm.good()) {
         Log::error("Cannot save startup file.\n");
-        send_reply(addr, ZMQ::bits_msg<uint8_t>(1));
+        send_seq_reply(addr, ZMQ::bits_msg<uint8_t>(1));
         return;
     }
     otstm.close();
@@ -570,80 +977,184 @@ void Server::process_set_startup(std::vector<zmq::message_t> &addr, zmq::message
     // I'm not really sure what to do if these fails so just ignore error....
     rename(ttmpname.c_str(), (m_conf.runtime_dir + "/startup.cmdlist").c_str());
     rename(btmpname.c_str(), (m_conf.runtime_dir + "/startup.cmdbin").c_str());
-    send_reply(addr, ZMQ::bits_msg<uint8_t>(0));
+    send_seq_reply(addr, ZMQ::bits_msg<uint8_t>(0));
 }
 
-template<typename CB>
-void Server::get_override_dds(CB cb)
+size_t Server::count_override_dds(uint32_t active)
 {
-    struct get_override_dds {
-        CB cb;
-        std::vector<uint8_t> res{};
-        ~get_override_dds()
-        {
-            // This should be called after everyone is done with the callback.
-            cb(std::move(res));
-        }
-    };
-    std::shared_ptr<get_override_dds> info(new get_override_dds{std::move(cb)});
-    for (int i: m_ctrl->get_active_dds()) {
+    auto &ovrs = m_ctrl->get_dds_ovrs();
+    return (__builtin_popcount(ovrs.mask[0] & active) +
+            __builtin_popcount(ovrs.mask[1] & active) +
+            __builtin_popcount(ovrs.mask[2] & active));
+}
+
+void Server::write_override_dds(uint8_t *res, uint32_t active)
+{
+    auto &ovrs = m_ctrl->get_dds_ovrs();
+    if (!(ovrs.mask[0] | ovrs.mask[1] | ovrs.mask[2]))
+        return;
+    for (int i = 0; i < 22; i++) {
+        if (!((active >> i) & 1))
+            continue;
         for (int typ = 0; typ < 3; typ++) {
-            m_ctrl->get_dds_ovr(dds_ops[typ], i,
-                                [info, typ, i] (uint32_t v) {
-                                    if (v == uint32_t(-1))
-                                        return;
-                                    push_dds_res(info->res, uint8_t((typ << 6) | i), v);
-                                });
+            if ((ovrs.mask[typ] >> i) & 1) {
+                *(res++) = uint8_t((typ << 6) | i);
+                memcpy(res, &ovrs.val[typ][i], 4);
+                res += 4;
+            }
         }
     }
 }
 
-void Server::process_zmq()
+void Server::process_net()
+{
+    auto addr = ZMQ::recv_addr(m_netsock);
+
+    zmq::message_t msg;
+    auto op = ServerOp::Invalid;
+    if (ZMQ::recv_more(m_netsock, msg))
+        op = parse_server_op(msg.data(), msg.size());
+    if (op == ServerOp::Invalid) {
+        Log::warn("Request validation failed.\n");
+        ZMQ::send_addr(m_netsock, addr, m_io_empty);
+        auto reply = ZMQ::bits_msg<uint8_t>(1);
+        ZMQ::send(m_netsock, reply);
+        ZMQ::readall(m_netsock);
+        return;
+    }
+    // `fire_seq` goes to the frontend directly so that it is never queued behind
+    // the sequences being decoded. Everything else goes through the sequence thread
+    // so that the requests from the same client are processed in order.
+    auto &sock = op == ServerOp::FireSeq ? m_iosock : m_io_seqsock;
+    ZMQ::send_addr(sock, addr, m_io_empty);
+    // Replace the request name with the opcode.
+    msg = ZMQ::bits_msg(uint8_t(op));
+    zmq::message_t next;
+    while (ZMQ::recv_more(m_netsock, next)) {
+        ZMQ::send_more(sock, msg);
+        msg = std::move(next);
+    }
+    ZMQ::send(sock, msg);
+}
+
+void Server::process_seq_req()
 {
-    auto addr = ZMQ::recv_addr(m_zmqsock);
+    auto addr = ZMQ::recv_addr(m_seqsock);
 
     zmq::message_t msg;
-    if (!recv_more(msg))
+    // The I/O thread replaces the request name with the opcode.
+    if (!seq_recv_more(msg) || msg.size() != 1)
         goto err;
-    if (ZMQ::match(msg, "run_seq")) {
+    switch (ServerOp(*(const uint8_t*)msg.data())) {
+    case ServerOp::RunSeq:
         if (!process_run_seq(addr, false)) {
             goto err;
         }
-    }
-    else if (ZMQ::match(msg, "run_cmdlist")) {
+        break;
+    case ServerOp::RunCmdList:
         if (!process_run_seq(addr, true)) {
             goto err;
         }
+        break;
+    case ServerOp::ArmSeq: {
+        CtrlIFace::SeqOpts opts;
+        opts.armed = true;
+        if (!process_run_seq(addr, false, opts)) {
+            goto err;
+        }
+        break;
     }
-    else if (ZMQ::match(msg, "wait_seq")) {
-        if (!recv_more(msg) || msg.size() != 17)
+    case ServerOp::RunSeqRepeat:
+        if (!process_run_seq_repeat(addr)) {
             goto err;
-        auto id = get_seq_id(msg, 1);
-        if (!id)
+        }
+        break;
+    case ServerOp::UploadSeq:
+        if (!process_upload_seq(addr)) {
             goto err;
-        uint8_t what = ((uint8_t*)msg.data())[16];
-        // Reserve what == 0 for sequence start. FIXME: implement waiting for sequence start.
-        what = uint8_t(what - 1);
-        if (what != 0 && what != 1)
+        }
+        break;
+    case ServerOp::RunSeqByHash:
+        if (!process_run_seq_by_hash(addr)) {
             goto err;
-        Log::info("Waiting for sequence %llu\n", (unsigned long long)id);
-        if (m_seq_status.empty() || m_seq_status[0].id > id) {
-            send_reply(addr, ZMQ::bits_msg<uint8_t>(0));
-            goto out;
         }
-        for (auto &status: m_seq_status) {
-            if (status.id != id)
-                continue;
-            if (what == 0 && status.flushed) {
-                send_reply(addr, ZMQ::bits_msg<uint8_t>(0));
-                goto out;
-            }
-            status.wait.push_back(SeqStatus::Wait{what, std::move(addr)});
-            goto out;
+        break;
+    case ServerOp::GetStartup: {
+        std::string str;
+        std::ifstream istm(m_conf.runtime_dir + "/startup.cmdlist");
+        if (istm.good())
+            str.append(std::istreambuf_iterator<char>(istm), {});
+        zmq::message_t msg(str.size() + 1);
+        memcpy(msg.data(), str.c_str(), str.size() + 1);
+        send_seq_reply(addr, msg);
+        break;
+    }
+    case ServerOp::SetStartup:
+        if (!seq_recv_more(msg) || msg.size() < 1)
+            goto err;
+        process_set_startup(addr, msg);
+        break;
+    case ServerOp::Invalid:
+    case ServerOp::QueueSeq:
+        goto err;
+    default: {
+        // Forward everything else to the frontend.
+        ZMQ::send_addr(m_seq_fwdsock, addr, m_seq_empty);
+        zmq::message_t next;
+        while (seq_recv_more(next)) {
+            ZMQ::send_more(m_seq_fwdsock, msg);
+            msg = std::move(next);
         }
+        ZMQ::send(m_seq_fwdsock, msg);
+        return;
+    }
+    }
+    goto out;
+err:
+    Log::warn("Request validation failed.\n");
+    send_seq_reply(addr, ZMQ::bits_msg<uint8_t>(1));
+out:
+    ZMQ::readall(m_seqsock);
+}
+
+void Server::process_zmq(zmq::socket_t &sock)
+{
+    m_reqsock = &sock;
+    auto addr = ZMQ::recv_addr(sock);
+
+    zmq::message_t msg;
+    // The I/O thread replaces the request name with the opcode.
+    if (!recv_more(msg) || msg.size() != 1)
         goto err;
+    switch (ServerOp(*(const uint8_t*)msg.data())) {
+    case ServerOp::FireSeq: {
+        if (!recv_more(msg))
+            goto err;
+        auto id = get_seq_id(msg);
+        if (!id)
+            goto err;
+        bool res = m_ctrl->fire_seq(id);
+        send_reply(addr, ZMQ::bits_msg<uint8_t>(!res));
+        Log::info("Firing sequence %llu%s\n", (unsigned long long)id,
+                  res ? "" : " failed");
+        break;
+    }
+    case ServerOp::QueueSeq: {
+        // From the sequence thread
+        if (!recv_more(msg) || msg.size() != sizeof(PreparedSeq*))
+            goto err;
+        PreparedSeq *seq;
+        memcpy(&seq, msg.data(), sizeof(seq));
+        queue_seq(std::unique_ptr<PreparedSeq>(seq));
+        break;
+    }
+    case ServerOp::WaitSeq: {
+        if (!recv_more(msg) || !process_wait_seq(addr, msg)) {
+            goto err;
+        }
+        break;
     }
-    else if (ZMQ::match(msg, "cancel_seq")) {
+    case ServerOp::CancelSeq: {
         bool res;
         if (!recv_more(msg)) {
             Log::info("Canceling all sequences\n");
@@ -657,18 +1168,39 @@ void Server::process_zmq()
             goto err;
         }
         send_reply(addr, ZMQ::bits_msg(!res));
+        break;
     }
-    else if (ZMQ::match(msg, "state_id")) {
+    case ServerOp::StateId: {
         std::array<uint64_t,2> id{m_ctrl->get_state_id(), m_id};
         nacsDbg("state_id\n");
         send_reply(addr, ZMQ::bits_msg(id));
+        break;
     }
-    else if (ZMQ::match(msg, "name_id")) {
+    case ServerOp::GetQueueInfo: {
+        nacsDbg("get_queue_info\n");
+        process_get_queue_info(addr);
+        break;
+    }
+    case ServerOp::GetSeqStats: {
+        nacsDbg("get_seq_stats\n");
+        process_get_seq_stats(addr);
+        break;
+    }
+    case ServerOp::DumpTrace: {
+        nacsDbg("dump_trace\n");
+        auto res = Trace::dump();
+        zmq::message_t reply(res.size());
+        memcpy(reply.data(), res.data(), res.size());
+        send_reply(addr, reply);
+        break;
+    }
+    case ServerOp::NameId: {
         std::array<uint64_t,2> id{m_name_id, m_id};
         nacsDbg("name_id\n");
         send_reply(addr, ZMQ::bits_msg(id));
+        break;
     }
-    else if (ZMQ::match(msg, "override_ttl")) {
+    case ServerOp::OverrideTTL: {
         if (!recv_more(msg))
             goto err;
         auto msg_sz = msg.size();
@@ -693,11 +1225,14 @@ void Server::process_zmq()
         }
         for (int i = 0; i < 3; i++)
             m_ctrl->set_ttl_ovr(bank, masks[i], i);
+        if (masks[0] || masks[1] || masks[2])
+            publish_ttl(bank, m_ctrl->get_ttl(bank));
         std::array<uint32_t,2> new_masks{m_ctrl->get_ttl_ovrlo(bank),
             m_ctrl->get_ttl_ovrhi(bank)};
         send_reply(addr, ZMQ::bits_msg(new_masks));
+        break;
     }
-    else if (ZMQ::match(msg, "set_ttl")) {
+    case ServerOp::SetTTL: {
         if (!recv_more(msg))
             goto err;
         auto msg_sz = msg.size();
@@ -726,29 +1261,35 @@ void Server::process_zmq()
         // value to avoid confusion.
         new_mask = (new_mask & ~masks[0]) | masks[1];
         send_reply(addr, ZMQ::bits_msg(new_mask));
+        if (masks[0] || masks[1])
+            publish_ttl(bank, new_mask);
+        break;
     }
-    else if (ZMQ::match(msg, "override_dds")) {
+    case ServerOp::OverrideDDS: {
         if (!recv_more(msg) || !process_set_dds(msg, true))
             goto err;
         Log::info("Override DDSs\n");
         send_reply(addr, ZMQ::bits_msg<uint8_t>(0));
+        publish(PubTopic::DDSOvr, msg.data(), msg.size());
+        break;
     }
-    else if (ZMQ::match(msg, "get_override_dds")) {
+    case ServerOp::GetOverrideDDS: {
         nacsDbg("get_override_dds\n");
-        get_override_dds([addr{std::move(addr)}, this] (const auto &res) mutable {
-            auto sz = res.size();
-            zmq::message_t msg(sz);
-            memcpy(msg.data(), &res[0], sz);
-            send_reply(addr, msg);
-        });
+        auto active = m_ctrl->get_active_dds_mask();
+        zmq::message_t reply(5 * count_override_dds(active));
+        write_override_dds((uint8_t*)reply.data(), active);
+        send_reply(addr, reply);
+        break;
     }
-    else if (ZMQ::match(msg, "set_dds")) {
+    case ServerOp::SetDDS: {
         if (!recv_more(msg) || !process_set_dds(msg, false))
             goto err;
         Log::info("Set DDSs\n");
         send_reply(addr, ZMQ::bits_msg<uint8_t>(0));
+        publish(PubTopic::DDS, msg.data(), msg.size());
+        break;
     }
-    else if (ZMQ::match(msg, "get_dds")) {
+    case ServerOp::GetDDS: {
         struct get_dds {
             Server *server;
             std::vector<zmq::message_t> addr;
@@ -793,8 +1334,9 @@ void Server::process_zmq()
                 }
             }
         }
+        break;
     }
-    else if (ZMQ::match(msg, "reset_dds")) {
+    case ServerOp::ResetDDS: {
         if (!recv_more(msg) || msg.size() != 1)
             goto err;
         int chn = *(char*)msg.data();
@@ -803,56 +1345,52 @@ void Server::process_zmq()
         Log::info("Reset DDS\n");
         m_ctrl->reset_dds(chn);
         send_reply(addr, ZMQ::bits_msg<uint8_t>(0));
+        publish(PubTopic::DDSReset, msg.data(), 1);
+        break;
     }
-    else if (ZMQ::match(msg, "set_clock")) {
+    case ServerOp::SetClock: {
         if (!recv_more(msg) || msg.size() != 1)
             goto err;
         Log::info("Set clock\n");
         uint8_t clock = *(uint8_t*)msg.data();
         m_ctrl->set_clock(clock);
         send_reply(addr, ZMQ::bits_msg<uint8_t>(0));
+        publish(PubTopic::Clock, &clock, 1);
+        break;
     }
-    else if (ZMQ::match(msg, "get_clock")) {
+    case ServerOp::GetClock: {
         m_ctrl->get_clock([addr{std::move(addr)}, this] (uint32_t v) mutable {
             send_reply(addr, ZMQ::bits_msg(uint8_t(v)));
         });
+        break;
     }
-    else if (ZMQ::match(msg, "set_ttl_names")) {
+    case ServerOp::SetTTLNames: {
         Log::info("Setting TTL names.\n");
         if (!recv_more(msg) || !process_set_names(msg, m_ttl_names))
             goto err;
         send_reply(addr, ZMQ::bits_msg<uint8_t>(0));
+        break;
     }
-    else if (ZMQ::match(msg, "get_max_ttl")) {
+    case ServerOp::GetMaxTTL: {
         send_reply(addr, ZMQ::bits_msg<uint8_t>(m_conf.max_ttl_chn));
+        break;
     }
-    else if (ZMQ::match(msg, "get_ttl_names")) {
+    case ServerOp::GetTTLNames: {
         process_get_names(addr, m_ttl_names);
+        break;
     }
-    else if (ZMQ::match(msg, "set_dds_names")) {
+    case ServerOp::SetDDSNames: {
         Log::info("Setting DDS names.\n");
         if (!recv_more(msg) || !process_set_names(msg, m_dds_names))
             goto err;
         send_reply(addr, ZMQ::bits_msg<uint8_t>(0));
+        break;
     }
-    else if (ZMQ::match(msg, "get_dds_names")) {
+    case ServerOp::GetDDSNames: {
         process_get_names(addr, m_dds_names);
+        break;
     }
-    else if (ZMQ::match(msg, "get_startup")) {
-        std::string str;
-        std::ifstream istm(m_conf.runtime_dir + "/startup.cmdlist");
-        if (istm.good())
-            str.append(std::istreambuf_iterator<char>(istm), {});
-        zmq::message_t msg(str.size() + 1);
-        memcpy(msg.data(), str.c_str(), str.size() + 1);
-        send_reply(addr, msg);
-    }
-    else if (ZMQ::match(msg, "set_startup")) {
-        if (!recv_more(msg) || msg.size() < 1)
-            goto err;
-        process_set_startup(addr, msg);
-    }
-    else {
+    default:
         goto err;
     }
     goto out;
@@ -860,7 +1398,7 @@ err:
     Log::warn("Request validation failed.\n");
     send_reply(addr, ZMQ::bits_msg<uint8_t>(1));
 out:
-    ZMQ::readall(m_zmqsock);
+    ZMQ::readall(sock);
 }
 
 }
@@ -21,10 +21,13 @@
 
 #include "ctrl_iface.h"
 #include "namesconfig.h"
+#include "seq_store.h"
 
+#include <nacs-utils/timer.h>
 #include <nacs-utils/zmq_utils.h>
 
 #include <atomic>
+#include <thread>
 
 namespace Molecube {
 
@@ -42,15 +45,34 @@ public:
     }
 
 private:
+    // Topics of the messages sent on the PUB socket.
+    enum class PubTopic : uint8_t {
+        TTL,
+        DDS,
+        DDSOvr,
+        DDSReset,
+        Clock,
+        Seq,
+        Names,
+        _Num
+    };
     struct SeqStatus {
         struct Wait {
             uint8_t what;
             std::vector<zmq::message_t> addr;
+            // Number of repetitions to wait for. `0` for waiting for the whole sequence.
+            uint32_t nfinished{0};
         };
         uint64_t id;
         std::vector<Wait> wait{};
         bool flushed{false};
+        uint32_t nfinished{0};
     };
+    // A validated and decoded sequence passed from the sequence thread to the frontend.
+    // Allocated for each sequence on the sequence thread
+    // so that the frontend doesn't need to allocate for it.
+    struct PreparedSeq;
+    struct SeqNotify;
 
     void send_reply(std::vector<zmq::message_t> &addr, zmq::message_t &msg);
     void send_reply(std::vector<zmq::message_t> &addr, zmq::message_t &&msg)
@@ -58,33 +80,103 @@ private:
         send_reply(addr, msg);
     }
     bool recv_more(zmq::message_t &msg);
-    void process_zmq();
+    // Used by the sequence thread to reply to the clients without the frontend.
+    void send_seq_reply(std::vector<zmq::message_t> &addr, zmq::message_t &msg);
+    void send_seq_reply(std::vector<zmq::message_t> &addr, zmq::message_t &&msg)
+    {
+        send_seq_reply(addr, msg);
+    }
+    bool seq_recv_more(zmq::message_t &msg);
+    // Send a state change notification to the subscribers (if enabled).
+    void publish(PubTopic topic, const void *data, size_t sz);
+    void publish_ttl(uint32_t bank, uint32_t val);
+    void publish_seq(uint64_t id, uint8_t state);
+    // The I/O thread receives all the requests from the clients
+    // and forwards the replies from the frontend and the sequence thread.
+    // `fire_seq` is forwarded to the frontend directly through `m_zmqsock`.
+    // Everything else goes to the sequence thread.
+    void io_thread();
+    void process_net();
+    void forward_reply(zmq::socket_t &sock);
+    // Requests for the sequences are parsed and decoded on the sequence thread and the ones
+    // that only need the sequence store or the startup file are handled there as well.
+    // Everything else is forwarded to the frontend through `m_fwdsock`.
+    void seq_thread();
+    void process_seq_req();
+    // Process a request from the I/O thread (`m_zmqsock`) or the sequence thread (`m_fwdsock`).
+    void process_zmq(zmq::socket_t &sock);
+    // Free the decoded sequences left in `m_fwdsock` after the other threads exited.
+    void drop_queued_seqs();
     // Read the sequence id from the message.
     // Check if the message is 16+suffix bytes and if the second 8 bytes matches the server id.
     // Return 0 if the check fails. Otherwise, return the 64bit int from the first 8 bytes.
     uint64_t get_seq_id(zmq::message_t &msg, size_t suffix=0);
     bool process_set_dds(zmq::message_t &msg, bool is_ovr);
-    bool process_run_seq(std::vector<zmq::message_t> &addr, bool is_cmd);
+    // Receive the version and the sequence parts of a `run_seq` or `upload_seq` request.
+    bool recv_seq(uint32_t &ver, zmq::message_t &msg);
+    bool process_run_seq(std::vector<zmq::message_t> &addr, bool is_cmd,
+                         const CtrlIFace::SeqOpts &opts=CtrlIFace::SeqOpts());
+    bool process_run_seq_repeat(std::vector<zmq::message_t> &addr);
+    bool process_wait_seq(std::vector<zmq::message_t> &addr, zmq::message_t &msg);
+    bool process_upload_seq(std::vector<zmq::message_t> &addr);
+    bool process_run_seq_by_hash(std::vector<zmq::message_t> &addr);
+    // Parse and decode the sequence and pass it to the frontend (sequence thread).
+    // `seq` keeps `data` alive until the sequence finishes.
+    bool prepare_seq(std::vector<zmq::message_t> &addr, std::unique_ptr<PreparedSeq> seq,
+                     const uint8_t *data, size_t sz);
+    // Send the sequence to the controller (frontend thread).
+    void queue_seq(std::unique_ptr<PreparedSeq> seq);
     SeqStatus *find_seqstatus(uint64_t id);
+    // Whether a new sequence using `sz` bytes would exceed the queue limits.
+    // Also used by the sequence thread with the size of the code before decoding it.
+    bool seq_queue_full(size_t sz) const;
+    void process_get_queue_info(std::vector<zmq::message_t> &addr);
     bool process_set_names(zmq::message_t &msg, NamesConfig &names);
     void process_get_names(std::vector<zmq::message_t> &addr, NamesConfig &names);
+    void process_get_seq_stats(std::vector<zmq::message_t> &addr);
     void ensure_runtime_dir();
     void run_startup();
+    // Parse and save the startup sequence (sequence thread).
     void process_set_startup(std::vector<zmq::message_t> &addr, zmq::message_t &msg);
 
-    template<typename CB>
-    void get_override_dds(CB cb);
+    // Number of the enabled DDS overrides on the DDS's in `active`
+    // (from `get_active_dds_mask`).
+    size_t count_override_dds(uint32_t active);
+    // Write the enabled DDS overrides to `res` (5 bytes each).
+    // `active` must be the same as the one passed to `count_override_dds`.
+    void write_override_dds(uint8_t *res, uint32_t active);
 
     const Config &m_conf;
     const uint64_t m_id;
     std::unique_ptr<CtrlIFace> m_ctrl;
     zmq::context_t m_zmqctx;
+    // Frontend end of the pipes to the I/O thread and the sequence thread.
+    // All the replies are sent on `m_zmqsock`.
     zmq::socket_t m_zmqsock;
-    zmq::pollitem_t m_zmqpoll[2];
+    zmq::socket_t m_fwdsock;
+    // The socket of the request being processed.
+    zmq::socket_t *m_reqsock = nullptr;
+    zmq::socket_t m_pubsock;
+    zmq::pollitem_t m_zmqpoll[3];
     zmq::message_t m_empty{0};
+    // The sockets below are only used by the I/O thread.
+    zmq::socket_t m_netsock;
+    zmq::socket_t m_iosock;
+    zmq::socket_t m_io_seqsock;
+    zmq::message_t m_io_empty{0};
+    std::thread m_io_thread;
+    // The sockets below are only used by the sequence thread.
+    zmq::socket_t m_seqsock;
+    zmq::socket_t m_seq_fwdsock;
+    zmq::message_t m_seq_empty{0};
+    std::thread m_seq_thread;
     volatile std::atomic_bool m_running{false};
     std::vector<SeqStatus> m_seq_status{};
+    // Only used by the sequence thread.
+    SeqStore m_seq_store;
     uint64_t m_name_id = 0;
+    // Sequence number of the next message for each topic.
+    std::array<uint64_t,size_t(PubTopic::_Num)> m_pub_cnt{};
     NamesConfig m_ttl_names;
     NamesConfig m_dds_names;
 };
@@ -0,0 +1,142 @@
+/*************************************************************************
+ *   Copyright (c) 2018 - 2018 Yichao Yu <yyc1992@gmail.com>             *
+ *                                                                       *
+ *   This library is free software; you can redistribute it and/or       *
+ *   modify it under the terms of the GNU Lesser General Public          *
+ *   License as published by the Free Software Foundation; either        *
+ *   version 3.0 of the License, or (at your option) any later version.  *
+ *                                                                       *
+ *   This library is distributed in the hope that it will be useful,     *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU    *
+ *   Lesser General Public License for more details.                     *
+ *                                                                       *
+ *   You should have received a copy of the GNU Lesser General Public    *
+ *   License along with this library. If not,                            *
+ *   see <http://www.gnu.org/licenses/>.                                 *
+ *************************************************************************/
+
+#include "server_op.h"
+
+#include <nacs-utils/utils.h>
+
+#include <string.h>
+
+namespace Molecube {
+
+namespace {
+
+static constexpr const char *op_names[size_t(ServerOp::_Num)] = {
+    nullptr,
+    "run_seq",
+    "run_cmdlist",
+    "arm_seq",
+    "fire_seq",
+    "run_seq_repeat",
+    "upload_seq",
+    "run_seq_by_hash",
+    "wait_seq",
+    "cancel_seq",
+    "state_id",
+    "get_queue_info",
+    "get_seq_stats",
+    "dump_trace",
+    "override_ttl",
+    "set_ttl",
+    "override_dds",
+    "get_override_dds",
+    "set_dds",
+    "get_dds",
+    "reset_dds",
+    "set_clock",
+    "get_clock",
+    "get_startup",
+    "set_startup",
+    "set_ttl_names",
+    "get_ttl_names",
+    "set_dds_names",
+    "get_dds_names",
+    "name_id",
+    "get_max_ttl",
+};
+
+static constexpr size_t const_strlen(const char *str)
+{
+    size_t len = 0;
+    while (str[len])
+        len++;
+    return len;
+}
+
+// Written byte by byte so that it can be used in constant expressions.
+// The compiler turns this into a single load at runtime.
+static constexpr uint32_t load32(const char *p)
+{
+    return (uint32_t(uint8_t(p[0])) | uint32_t(uint8_t(p[1])) << 8 |
+            uint32_t(uint8_t(p[2])) << 16 | uint32_t(uint8_t(p[3])) << 24);
+}
+
+// Perfect hash of the names (`sz >= 4`). The first, middle and last 4 bytes together
+// with the length are unique for all the names and the multiplier is picked
+// so that the top `hash_bits` bits of the product are also unique.
+// The `static_assert` below checks this when a new name is added.
+static constexpr int hash_bits = 6;
+static constexpr unsigned name_hash(const char *p, size_t sz)
+{
+    uint64_t key = ((load32(p) | uint64_t(load32(p + sz - 4)) << 32) ^
+                    uint64_t(load32(p + sz / 2 - 2)) << 16 ^ sz);
+    return unsigned((key * 0xd11c1147b4a501ffull) >> (64 - hash_bits));
+}
+
+struct NameTable {
+    uint8_t ops[1 << hash_bits];
+    uint8_t lens[size_t(ServerOp::_Num)];
+    bool perfect;
+};
+
+static constexpr NameTable build_name_table()
+{
+    NameTable table{{}, {}, true};
+    for (size_t op = 1; op < size_t(ServerOp::_Num); op++) {
+        auto name = op_names[op];
+        auto len = const_strlen(name);
+        table.lens[op] = uint8_t(len);
+        auto h = name_hash(name, len);
+        if (len < 4 || table.ops[h])
+            table.perfect = false;
+        table.ops[h] = uint8_t(op);
+    }
+    return table;
+}
+
+static constexpr NameTable name_table = build_name_table();
+static_assert(name_table.perfect, "Collision in the request name hash, pick a new multiplier.");
+
+}
+
+NACS_EXPORT() ServerOp parse_server_op(const void *data, size_t sz)
+{
+    if (sz == 1 || sz == 2) {
+        uint16_t op = 0;
+        memcpy(&op, data, sz);
+        if (op == 0 || op >= uint16_t(ServerOp::_Num))
+            return ServerOp::Invalid;
+        return ServerOp(op);
+    }
+    if (sz < 4)
+        return ServerOp::Invalid;
+    auto p = (const char*)data;
+    auto op = name_table.ops[name_hash(p, sz)];
+    if (!op || name_table.lens[op] != sz || memcmp(op_names[op], p, sz) != 0)
+        return ServerOp::Invalid;
+    return ServerOp(op);
+}
+
+NACS_EXPORT() const char *server_op_name(ServerOp op)
+{
+    if (uint8_t(op) >= uint8_t(ServerOp::_Num))
+        return nullptr;
+    return op_names[uint8_t(op)];
+}
+
+}
@@ -0,0 +1,84 @@
+/*************************************************************************
+ *   Copyright (c) 2018 - 2018 Yichao Yu <yyc1992@gmail.com>             *
+ *                                                                       *
+ *   This library is free software; you can redistribute it and/or       *
+ *   modify it under the terms of the GNU Lesser General Public          *
+ *   License as published by the Free Software Foundation; either        *
+ *   version 3.0 of the License, or (at your option) any later version.  *
+ *                                                                       *
+ *   This library is distributed in the hope that it will be useful,     *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU    *
+ *   Lesser General Public License for more details.                     *
+ *                                                                       *
+ *   You should have received a copy of the GNU Lesser General Public    *
+ *   License along with this library. If not,                            *
+ *   see <http://www.gnu.org/licenses/>.                                 *
+ *************************************************************************/
+
+#ifndef LIBMOLECUBE_SERVER_OP_H
+#define LIBMOLECUBE_SERVER_OP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace Molecube {
+
+/**
+ * Opcodes of the requests.
+ *
+ * The values are part of the protocol (see README) and must not be changed.
+ * New requests should only be added before `_Num`.
+ */
+enum class ServerOp : uint8_t {
+    Invalid = 0,
+    RunSeq,
+    RunCmdList,
+    ArmSeq,
+    FireSeq,
+    RunSeqRepeat,
+    UploadSeq,
+    RunSeqByHash,
+    WaitSeq,
+    CancelSeq,
+    StateId,
+    GetQueueInfo,
+    GetSeqStats,
+    DumpTrace,
+    OverrideTTL,
+    SetTTL,
+    OverrideDDS,
+    GetOverrideDDS,
+    SetDDS,
+    GetDDS,
+    ResetDDS,
+    SetClock,
+    GetClock,
+    GetStartup,
+    SetStartup,
+    SetTTLNames,
+    GetTTLNames,
+    SetDDSNames,
+    GetDDSNames,
+    NameId,
+    GetMaxTTL,
+    _Num,
+    // Only used between the threads of the server and never accepted from the clients.
+    QueueSeq = 0xff
+};
+
+/**
+ * Decode the first part of a request.
+ * This can be either a 1 or 2 bytes (little endian) opcode or the name of the request.
+ * Return `ServerOp::Invalid` if the request is unknown.
+ */
+ServerOp parse_server_op(const void *data, size_t sz);
+
+/**
+ * Name of the request. `nullptr` for `ServerOp::Invalid` and the internal ones.
+ */
+const char *server_op_name(ServerOp op);
+
+}
+
+#endif // LIBMOLECUBE_SERVER_OP_H
@@ -0,0 +1,62 @@
+/*************************************************************************
+ *   Copyright (c) 2018 - 2018 Yichao Yu <yyc1992@gmail.com>             *
+ *                                                                       *
+ *   This library is free software; you can redistribute it and/or       *
+ *   modify it under the terms of the GNU Lesser General Public          *
+ *   License as published by the Free Software Foundation; either        *
+ *   version 3.0 of the License, or (at your option) any later version.  *
+ *                                                                       *
+ *   This library is distributed in the hope that it will be useful,     *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU    *
+ *   Lesser General Public License for more details.                     *
+ *                                                                       *
+ *   You should have received a copy of the GNU Lesser General Public    *
+ *   License along with this library. If not,                            *
+ *   see <http://www.gnu.org/licenses/>.                                 *
+ *************************************************************************/
+
+#ifndef LIBMOLECUBE_SHA256_H
+#define LIBMOLECUBE_SHA256_H
+
+#include <nacs-utils/utils.h>
+
+#include <array>
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace Molecube {
+
+using namespace NaCs;
+
+/**
+ * SHA-256 (FIPS 180-4) for identifying the content of sequences.
+ */
+class SHA256 {
+public:
+    using Digest = std::array<uint8_t,32>;
+
+    SHA256();
+    void update(const void *data, size_t len);
+    // Finish the hash. The object should not be used afterward.
+    Digest final();
+
+    static Digest digest(const void *data, size_t len)
+    {
+        SHA256 h;
+        h.update(data, len);
+        return h.final();
+    }
+
+private:
+    void block(const uint8_t *p);
+
+    uint32_t m_state[8];
+    uint64_t m_len = 0;
+    uint8_t m_buff[64];
+};
+
+}
+
+#endif
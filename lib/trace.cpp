@@ -0,0 +1,216 @@
+/*************************************************************************
+ *   Copyright (c) 2018 - 2018 Yichao Yu <yyc1992@gmail.com>             *
+ *                                                                       *
+ *   This library is free software; you can redistribute it and/or       *
+ *   modify it under the terms of the GNU Lesser General Public          *
+ *   License as published by the Free Software Foundation; either        *
+ *   version 3.0 of the License, or (at your option) any later version.  *
+ *                                                                       *
+ *   This library is distributed in the hope that it will be useful,     *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU    *
+ *   Lesser General Public License for more details.                     *
+ *                                                                       *
+ *   You should have received a copy of the GNU Lesser General Public    *
+ *   License along with this library. If not,                            *
+ *   see <http://www.gnu.org/licenses/>.                                 *
+ *************************************************************************/
+
+#include "trace.h"
+
+#include <nacs-utils/timer.h>
+
+#include <assert.h>
+#include <string.h>
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+
+#if defined(__x86_64__) || defined(__i386__)
+#  include <x86intrin.h>
+#endif
+
+namespace Molecube {
+namespace Trace {
+
+namespace {
+
+const char *const event_names[NEvents] = {
+    "run_seq",
+    "preamble",
+    "repeat",
+    "wait_fire",
+    "release_hold",
+    "flush",
+    "end_marker",
+    "cmd_run",
+    "cmd_result",
+    "wait_sleep",
+    "dma_lower",
+};
+
+// The events are time stamped with a counter that is much cheaper to read than
+// `getTime()` and converted to `getTime()` when dumping.
+#if defined(__x86_64__) || defined(__i386__)
+inline uint64_t read_counter()
+{
+    return __rdtsc();
+}
+static constexpr bool counter_is_time = false;
+#elif defined(__aarch64__)
+inline uint64_t read_counter()
+{
+    uint64_t v;
+    asm volatile("mrs %0, cntvct_el0" : "=r"(v));
+    return v;
+}
+static constexpr bool counter_is_time = false;
+#else
+// The Cortex-A9 in Zynq doesn't have a counter readable from user space.
+// The coarse clock only advances on timer ticks
+// but it doesn't need a system call to read.
+inline uint64_t read_counter()
+{
+    return getCoarseTime();
+}
+static constexpr bool counter_is_time = true;
+#endif
+
+struct TimeRef {
+    uint64_t counter;
+    uint64_t t;
+    static TimeRef now()
+    {
+        auto t0 = getTime();
+        auto counter = read_counter();
+        auto t1 = getTime();
+        return {counter, t0 + (t1 - t0) / 2};
+    }
+};
+
+/**
+ * Each slot is protected by its own sequence number so that the reader can detect
+ * slots that are overwritten while they are being read.
+ * The sequence number is `0` while the slot is being written and `index + 1` afterwards.
+ */
+struct Slot {
+    std::atomic<uint64_t> seq{0};
+    std::atomic<uint64_t> t{0};
+    // `[event: 16bits][phase: 8bits][0: 8bits][arg: 32bits]`
+    std::atomic<uint64_t> info{0};
+};
+
+struct Ring {
+    Ring(const char *name)
+        : name(name)
+    {
+    }
+    void record(Event ev, Phase phase, uint32_t arg)
+    {
+        auto idx = head.load(std::memory_order_relaxed);
+        auto &slot = slots[idx % ring_size];
+        slot.seq.store(0, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        slot.t.store(read_counter(), std::memory_order_relaxed);
+        slot.info.store(uint64_t(ev) | uint64_t(phase) << 16 | uint64_t(arg) << 32,
+                        std::memory_order_relaxed);
+        slot.seq.store(idx + 1, std::memory_order_release);
+        head.store(idx + 1, std::memory_order_release);
+    }
+    const char *const name;
+    std::atomic<uint64_t> head{0};
+    Slot slots[ring_size];
+};
+
+std::mutex rings_lock;
+// Never freed so that the events are still available after the thread exits.
+std::vector<std::unique_ptr<Ring>> rings;
+// Taken when the first ring is created.
+TimeRef time_ref;
+thread_local Ring *tls_ring __attribute__((tls_model("initial-exec"))) = nullptr;
+
+template<typename T>
+void push_bytes(std::vector<uint8_t> &res, T v)
+{
+    auto oldn = res.size();
+    res.resize(oldn + sizeof(v));
+    memcpy(&res[oldn], &v, sizeof(v));
+}
+
+void push_str(std::vector<uint8_t> &res, const char *str)
+{
+    res.insert(res.end(), str, str + strlen(str) + 1);
+}
+
+}
+
+NACS_EXPORT() void init_thread(const char *name)
+{
+    assert(!tls_ring);
+    auto ring = new Ring(name);
+    {
+        std::lock_guard<std::mutex> locker(rings_lock);
+        if (rings.empty())
+            time_ref = TimeRef::now();
+        rings.emplace_back(ring);
+    }
+    tls_ring = ring;
+}
+
+NACS_EXPORT() void record(Event ev, Phase phase, uint32_t arg)
+{
+    if (auto ring = tls_ring) {
+        ring->record(ev, phase, arg);
+    }
+}
+
+NACS_EXPORT() std::vector<uint8_t> dump()
+{
+    std::vector<uint8_t> res;
+    push_bytes<uint32_t>(res, NEvents);
+    for (auto name: event_names)
+        push_str(res, name);
+    std::lock_guard<std::mutex> locker(rings_lock);
+    // Calibrate the counter against `getTime()` over the time since the first ring.
+    double scale = 1;
+    if (!counter_is_time && !rings.empty()) {
+        auto ref = TimeRef::now();
+        if (ref.counter > time_ref.counter) {
+            scale = double(ref.t - time_ref.t) / double(ref.counter - time_ref.counter);
+        }
+    }
+    auto to_time = [&] (uint64_t counter) {
+        if (counter_is_time)
+            return counter;
+        return uint64_t(int64_t(time_ref.t) +
+                        int64_t(double(int64_t(counter - time_ref.counter)) * scale));
+    };
+    push_bytes<uint32_t>(res, uint32_t(rings.size()));
+    for (auto &ring: rings) {
+        push_str(res, ring->name);
+        auto nevents_pos = res.size();
+        push_bytes<uint32_t>(res, 0);
+        auto head = ring->head.load(std::memory_order_acquire);
+        uint32_t nevents = 0;
+        for (auto idx = head > ring_size ? head - ring_size : 0; idx < head; idx++) {
+            auto &slot = ring->slots[idx % ring_size];
+            if (slot.seq.load(std::memory_order_acquire) != idx + 1)
+                continue;
+            auto t = slot.t.load(std::memory_order_relaxed);
+            auto info = slot.info.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            // Overwritten while we are reading it.
+            if (slot.seq.load(std::memory_order_relaxed) != idx + 1)
+                continue;
+            push_bytes(res, to_time(t));
+            push_bytes(res, info);
+            nevents++;
+        }
+        memcpy(&res[nevents_pos], &nevents, 4);
+    }
+    return res;
+}
+
+}
+}
@@ -0,0 +1,111 @@
+/*************************************************************************
+ *   Copyright (c) 2018 - 2018 Yichao Yu <yyc1992@gmail.com>             *
+ *                                                                       *
+ *   This library is free software; you can redistribute it and/or       *
+ *   modify it under the terms of the GNU Lesser General Public          *
+ *   License as published by the Free Software Foundation; either        *
+ *   version 3.0 of the License, or (at your option) any later version.  *
+ *                                                                       *
+ *   This library is distributed in the hope that it will be useful,     *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU    *
+ *   Lesser General Public License for more details.                     *
+ *                                                                       *
+ *   You should have received a copy of the GNU Lesser General Public    *
+ *   License along with this library. If not,                            *
+ *   see <http://www.gnu.org/licenses/>.                                 *
+ *************************************************************************/
+
+#ifndef LIBMOLECUBE_TRACE_H
+#define LIBMOLECUBE_TRACE_H
+
+#include <nacs-utils/utils.h>
+
+#include <stdint.h>
+
+#include <vector>
+
+namespace Molecube {
+
+using namespace NaCs;
+
+/**
+ * Low overhead event trace of the backend threads.
+ *
+ * Each thread that calls `init_thread` gets its own fixed size ring of
+ * time stamped events. Recording an event only writes to the ring of the current thread
+ * without any lock or read-modify-write operation and the oldest events are overwritten
+ * when the ring is full. Events recorded on other threads are ignored.
+ * `dump` can be called from any thread to get a consistent snapshot of all the rings.
+ */
+namespace Trace {
+
+// Update `event_names` in `trace.cpp` when adding new events.
+enum Event : uint16_t {
+    RunSeq,
+    Preamble,
+    Repeat,
+    WaitFire,
+    ReleaseHold,
+    Flush,
+    EndMarker,
+    CmdRun,
+    CmdResult,
+    WaitSleep,
+    DMALower,
+    NEvents
+};
+
+enum Phase : uint8_t {
+    Begin = 'B',
+    End = 'E',
+    Instant = 'i',
+};
+
+// Number of events kept for each thread.
+static constexpr uint32_t ring_size = 4096;
+
+// Start recording the events on the current thread. Must be called at most once per thread.
+void init_thread(const char *name);
+void record(Event ev, Phase phase, uint32_t arg=0);
+
+// Records a begin and an end event for the lifetime of the object.
+class Scope {
+    Scope(const Scope&) = delete;
+    void operator=(const Scope&) = delete;
+public:
+    Scope(Event ev, uint32_t arg=0)
+        : m_ev(ev)
+    {
+        record(ev, Begin, arg);
+    }
+    ~Scope()
+    {
+        record(m_ev, End);
+    }
+
+private:
+    const Event m_ev;
+};
+
+/**
+ * Serialize the events from all threads in the format,
+ *
+ *     [nevent_names: 4bytes][[event_name: NUL terminated] x nevent_names]
+ *     [nthreads: 4bytes]
+ *     [[thread_name: NUL terminated][nevents: 4bytes]
+ *      [[time: 8bytes][event: 2bytes][phase: 1byte][0: 1byte][arg: 4bytes] x nevents]
+ *      x nthreads]
+ *
+ * The time is in ns from `getTime()`. The events for each thread are in the order
+ * they are recorded. The events are time stamped with the TSC (x86) or the virtual counter
+ * (AArch64), which are converted to `getTime()` with a calibration over the time
+ * since the first `init_thread`, or with `getCoarseTime()` on other architectures.
+ */
+std::vector<uint8_t> dump();
+
+}
+
+}
+
+#endif
@@ -0,0 +1,55 @@
+/*************************************************************************
+ *   Copyright (c) 2018 - 2018 Yichao Yu <yyc1992@gmail.com>             *
+ *                                                                       *
+ *   This library is free software; you can redistribute it and/or       *
+ *   modify it under the terms of the GNU Lesser General Public          *
+ *   License as published by the Free Software Foundation; either        *
+ *   version 3.0 of the License, or (at your option) any later version.  *
+ *                                                                       *
+ *   This library is distributed in the hope that it will be useful,     *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU    *
+ *   Lesser General Public License for more details.                     *
+ *                                                                       *
+ *   You should have received a copy of the GNU Lesser General Public    *
+ *   License along with this library. If not,                            *
+ *   see <http://www.gnu.org/licenses/>.                                 *
+ *************************************************************************/
+
+#ifndef LIBMOLECUBE_TEST_ALLOC_COUNTER_H
+#define LIBMOLECUBE_TEST_ALLOC_COUNTER_H
+
+// Replace the global `operator new` to count the allocations made on the threads
+// that set `counting_allocs` (`nallocs`) and on all threads (`nallocs_all`).
+// Include in only one file of a test.
+
+#include <stdlib.h>
+
+#include <atomic>
+#include <new>
+
+static std::atomic<size_t> nallocs{0};
+static std::atomic<size_t> nallocs_all{0};
+static thread_local bool counting_allocs = false;
+
+void *operator new(size_t sz)
+{
+    if (counting_allocs)
+        nallocs.fetch_add(1, std::memory_order_relaxed);
+    nallocs_all.fetch_add(1, std::memory_order_relaxed);
+    if (auto p = malloc(sz ? sz : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    free(p);
+}
+
+#endif
@@ -151,3 +151,9 @@ elif cmd == 'reset_dds':
     sock.send(int(sys.argv[3]).to_bytes(1, byteorder=sys.byteorder, signed=False))
     msg = sock.recv()
     print(msg)
+elif cmd == 'dump_trace':
+    sock.send_string("dump_trace")
+    msg = sock.recv()
+    with open(sys.argv[3], 'wb') as fh:
+        fh.write(msg)
+    print("%d bytes" % len(msg))
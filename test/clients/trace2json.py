@@ -0,0 +1,68 @@
+#!/usr/bin/python
+
+# Convert the result of `dump_trace` to the Chrome trace event format.
+# Usage: trace2json.py <dump file> <output json>
+# The dump can be obtained with `test_client.py <addr> dump_trace <dump file>`.
+
+import json
+import struct
+import sys
+
+assert len(sys.argv) >= 3
+
+with open(sys.argv[1], 'rb') as fh:
+    data = fh.read()
+
+pos = 0
+
+def read_u32():
+    global pos
+    v, = struct.unpack_from('<I', data, pos)
+    pos += 4
+    return v
+
+def read_str():
+    global pos
+    end = data.index(b'\0', pos)
+    s = data[pos:end].decode()
+    pos = end + 1
+    return s
+
+event_names = [read_str() for i in range(read_u32())]
+
+threads = []
+for tid in range(read_u32()):
+    name = read_str()
+    events = []
+    for i in range(read_u32()):
+        t, ev, phase, arg = struct.unpack_from('<QHBxI', data, pos)
+        pos += 16
+        events.append((t, ev, phase, arg))
+    threads.append((name, events))
+
+t0 = min((events[0][0] for name, events in threads if events), default=0)
+
+res = []
+for tid, (name, events) in enumerate(threads):
+    res.append({'name': 'thread_name', 'ph': 'M', 'pid': 0, 'tid': tid,
+                'args': {'name': name}})
+    # The ring may start in the middle of a scope, skip the unmatched end events.
+    depth = 0
+    for t, ev, phase, arg in events:
+        phase = chr(phase)
+        if phase == 'B':
+            depth += 1
+        elif phase == 'E':
+            if depth == 0:
+                continue
+            depth -= 1
+        event = {'name': event_names[ev], 'ph': phase, 'pid': 0, 'tid': tid,
+                 'ts': (t - t0) / 1000}
+        if phase == 'i':
+            event['s'] = 't'
+        if phase != 'E':
+            event['args'] = {'arg': arg}
+        res.append(event)
+
+with open(sys.argv[2], 'w') as fh:
+    json.dump({'traceEvents': res, 'displayTimeUnit': 'ns'}, fh)
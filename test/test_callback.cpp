@@ -0,0 +1,136 @@
+/*************************************************************************
+ *   Copyright (c) 2018 - 2018 Yichao Yu <yyc1992@gmail.com>             *
+ *                                                                       *
+ *   This library is free software; you can redistribute it and/or       *
+ *   modify it under the terms of the GNU Lesser General Public          *
+ *   License as published by the Free Software Foundation; either        *
+ *   version 3.0 of the License, or (at your option) any later version.  *
+ *                                                                       *
+ *   This library is distributed in the hope that it will be useful,     *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU    *
+ *   Lesser General Public License for more details.                     *
+ *                                                                       *
+ *   You should have received a copy of the GNU Lesser General Public    *
+ *   License along with this library. If not,                            *
+ *   see <http://www.gnu.org/licenses/>.                                 *
+ *************************************************************************/
+
+#include "../lib/ctrl_iface.h"
+
+#include "alloc_counter.h"
+
+#include <nacs-utils/timer.h>
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <memory>
+#include <vector>
+
+using namespace Molecube;
+
+// Count the allocations made for the `get_dds` requests
+// with the same callbacks as the ones used in the server.
+
+static constexpr CtrlIFace::ReqOP dds_ops[3] = {CtrlIFace::DDSFreq, CtrlIFace::DDSAmp,
+                                                CtrlIFace::DDSPhase};
+
+struct Request {
+    std::vector<uint8_t> res;
+};
+
+static void push_res(std::vector<uint8_t> &res, uint8_t chn, uint32_t v)
+{
+    auto oldn = res.size();
+    res.resize(oldn + 5);
+    res[oldn] = chn;
+    memcpy(&res[oldn + 1], &v, 4);
+}
+
+// Return the number of allocations per request.
+template<typename Func>
+static double bench(const char *name, CtrlIFace &ctrl, int n, Func &&func)
+{
+    size_t total = 0;
+    uint64_t t = 0;
+    for (int i = 0; i < n; i++) {
+        auto info = std::make_shared<Request>();
+        // Take the allocation of the reply out of the count.
+        info->res.reserve(5 * 3 * 22);
+        auto c0 = nallocs.load(std::memory_order_relaxed);
+        auto t0 = getTime();
+        func(info);
+        // Wait for all the callbacks to finish.
+        while (info.use_count() > 1)
+            ctrl.run_frontend();
+        t += getTime() - t0;
+        total += nallocs.load(std::memory_order_relaxed) - c0;
+    }
+    printf("%s: %.2f allocations, %.2f us per request\n", name, double(total) / n,
+           double(t) / n / 1000);
+    return double(total) / n;
+}
+
+int main()
+{
+    counting_allocs = true;
+    auto ctrl = CtrlIFace::create(true);
+    auto dds = ctrl->get_active_dds();
+    for (int i: dds)
+        ctrl->set_dds_ovr(CtrlIFace::DDSAmp, i, 100);
+
+    // The captures used by the server are stored inline in the callback.
+    {
+        auto info = std::make_shared<Request>();
+        info->res.reserve(5);
+        int typ = 1, i = 2;
+        auto c0 = nallocs.load(std::memory_order_relaxed);
+        CtrlIFace::callback_t cb([info, typ, i] (uint32_t v) {
+            push_res(info->res, uint8_t((typ << 6) | i), v);
+        });
+        CtrlIFace::callback_t cb2(std::move(cb));
+        assert(!cb && cb2);
+        cb2(100);
+        assert(nallocs.load(std::memory_order_relaxed) == c0);
+        assert(info->res.size() == 5);
+    }
+
+    // The values that can't be read directly from the hardware or the cache
+    // allocate for the command sent to the backend but not for the callbacks.
+    auto get_dds = bench("get_dds", *ctrl, 1000, [&] (auto &info) {
+        for (int i: dds) {
+            for (int typ = 0; typ < 3; typ++) {
+                ctrl->get_dds(dds_ops[typ], i, [info, typ, i] (uint32_t v) {
+                    push_res(info->res, uint8_t((typ << 6) | i), v);
+                });
+            }
+        }
+    });
+    assert(get_dds < 1);
+    auto get_dds_ovr = bench("get_dds_ovr", *ctrl, 1000, [&] (auto &info) {
+        for (int i: dds) {
+            for (int typ = 0; typ < 3; typ++) {
+                ctrl->get_dds_ovr(dds_ops[typ], i, [info, typ, i] (uint32_t v) {
+                    if (v != uint32_t(-1)) {
+                        push_res(info->res, uint8_t((typ << 6) | i), v);
+                    }
+                });
+            }
+        }
+    });
+    assert(get_dds_ovr == 0);
+    auto get_dds_ovrs = bench("get_dds_ovrs", *ctrl, 1000, [&] (auto &info) {
+        auto &ovrs = ctrl->get_dds_ovrs();
+        for (int i: dds) {
+            for (int typ = 0; typ < 3; typ++) {
+                if ((ovrs.mask[typ] >> i) & 1) {
+                    push_res(info->res, uint8_t((typ << 6) | i), ovrs.val[typ][i]);
+                }
+            }
+        }
+    });
+    assert(get_dds_ovrs == 0);
+    return 0;
+}
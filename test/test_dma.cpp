@@ -0,0 +1,108 @@
+/*************************************************************************
+ *   Copyright (c) 2018 - 2018 Yichao Yu <yyc1992@gmail.com>             *
+ *                                                                       *
+ *   This library is free software; you can redistribute it and/or       *
+ *   modify it under the terms of the GNU Lesser General Public          *
+ *   License as published by the Free Software Foundation; either        *
+ *   version 3.0 of the License, or (at your option) any later version.  *
+ *                                                                       *
+ *   This library is distributed in the hope that it will be useful,     *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU    *
+ *   Lesser General Public License for more details.                     *
+ *                                                                       *
+ *   You should have received a copy of the GNU Lesser General Public    *
+ *   License along with this library. If not,                            *
+ *   see <http://www.gnu.org/licenses/>.                                 *
+ *************************************************************************/
+
+#include "../lib/dma_stream.h"
+#include "../lib/pulser.h"
+#include "../lib/dummy_pulser.h"
+
+#include <stdio.h>
+#include <thread>
+
+#include <nacs-utils/log.h>
+
+template<typename P>
+void test_dma(P &p)
+{
+    using namespace Molecube;
+
+    Molecube::DMAStream<P> stm(p);
+    if (!stm.init()) {
+        NaCs::Log::warn("DMA buffer not available!\n");
+        return;
+    }
+
+    printf("  Testing TTL pulses\n");
+    p.toggle_init();
+    p.set_hold();
+    stm.reset();
+    // Enough pulses to span multiple buffers and to overflow the command FIFO
+    // but not the ring so that the stream can be queued under hold.
+    const int n = 100000;
+    for (int i = 0; i < n; i++)
+        stm.template ttl<false>(uint32_t(i), 10, 0);
+    stm.template dds_set_freq<false>(1, 12345);
+    stm.template loopback<false>(888);
+    stm.finish();
+    auto blocks = stm.blocks_queued();
+    assert(blocks == (n + 2 + DMA_BLOCK_PULSES - 1) / DMA_BLOCK_PULSES);
+    p.release_hold();
+    assert(p.get_result() == 888);
+    assert(p.cur_ttl(0) == n - 1);
+    while (p.dma_busy()) {
+        std::this_thread::yield();
+    }
+    while (!p.is_finished()) {
+    }
+    assert(p.dma_blocks_done() == blocks);
+
+    printf("  Testing streaming\n");
+    // Longer than the ring so the producer has to wait for the FPGA.
+    p.toggle_init();
+    stm.reset();
+    stm.set_started();
+    const int nlong = DMAStream<P>::ring_size * DMAStream<P>::chunk_size / 8 * 3;
+    for (int i = 0; i < nlong; i++)
+        stm.template ttl<false>(uint32_t(i), 10, 0);
+    stm.template loopback<false>(777);
+    stm.finish();
+    assert(p.get_result() == 777);
+    assert(p.cur_ttl(0) == nlong - 1);
+    while (!p.is_finished()) {
+    }
+    printf("  Underruns: %llu\n", (unsigned long long)stm.underruns());
+
+    printf("  Testing DDS readback\n");
+    p.toggle_init();
+    p.release_hold();
+    stm.reset();
+    stm.template dds_get_freq<false>(1);
+    stm.template loopback<false>(999);
+    stm.finish();
+    assert(p.get_result() == 12345);
+    assert(p.get_result() == 999);
+    while (!p.is_finished()) {
+    }
+}
+
+int main()
+{
+    if (auto addr = Molecube::Pulser::address()) {
+        printf("Real pulser:\n");
+        Molecube::Pulser p(addr);
+        test_dma(p);
+    }
+    else {
+        NaCs::Log::warn("Pulse not enabled!\n");
+    }
+
+    printf("Dummy pulser:\n");
+    Molecube::DummyPulser dp;
+    test_dma(dp);
+
+    return 0;
+}
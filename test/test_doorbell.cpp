@@ -0,0 +1,137 @@
+/*************************************************************************
+ *   Copyright (c) 2018 - 2018 Yichao Yu <yyc1992@gmail.com>             *
+ *                                                                       *
+ *   This library is free software; you can redistribute it and/or       *
+ *   modify it under the terms of the GNU Lesser General Public          *
+ *   License as published by the Free Software Foundation; either        *
+ *   version 3.0 of the License, or (at your option) any later version.  *
+ *                                                                       *
+ *   This library is distributed in the hope that it will be useful,     *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU    *
+ *   Lesser General Public License for more details.                     *
+ *                                                                       *
+ *   You should have received a copy of the GNU Lesser General Public    *
+ *   License along with this library. If not,                            *
+ *   see <http://www.gnu.org/licenses/>.                                 *
+ *************************************************************************/
+
+#include "../lib/doorbell.h"
+#include "../lib/seq_stats.h"
+
+#include <nacs-utils/timer.h>
+
+#include <stdio.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+using namespace Molecube;
+
+// Latency from submitting a request to the consumer picking it up,
+// with the mutex/condition variable notification and with the doorbell.
+
+static uint64_t percentile(const LatencyHistogram &hist, double p)
+{
+    uint64_t target = uint64_t(double(hist.total()) * p);
+    uint64_t cnt = 0;
+    for (int b = 0; b < LatencyHistogram::nbuckets; b++) {
+        cnt += hist.count(b);
+        if (cnt > target) {
+            return LatencyHistogram::lower_bound(b);
+        }
+    }
+    return 0;
+}
+
+static void print_hist(const char *name, const LatencyHistogram &hist)
+{
+    printf("  %s: p50 %llu ns, p90 %llu ns, p99 %llu ns, p99.9 %llu ns\n", name,
+           (unsigned long long)percentile(hist, 0.5), (unsigned long long)percentile(hist, 0.9),
+           (unsigned long long)percentile(hist, 0.99),
+           (unsigned long long)percentile(hist, 0.999));
+}
+
+struct CondVar {
+    std::mutex lock;
+    std::condition_variable cond;
+    void notify()
+    {
+        {
+            std::lock_guard<std::mutex> locker(lock);
+        }
+        cond.notify_all();
+    }
+    template<typename Pred>
+    void wait(Pred &&pred)
+    {
+        std::unique_lock<std::mutex> locker(lock);
+        cond.wait(locker, pred);
+    }
+};
+
+struct Bell {
+    Doorbell bell;
+    void notify()
+    {
+        bell.ring();
+    }
+    template<typename Pred>
+    void wait(Pred &&pred)
+    {
+        bell.wait(pred, -1);
+    }
+};
+
+template<typename Notifier>
+static LatencyHistogram run(int n, uint64_t interval)
+{
+    Notifier notifier;
+    // Time stamp of the pending request. `0` if there's none.
+    std::atomic<uint64_t> slot{0};
+    std::atomic<bool> done{false};
+    LatencyHistogram hist;
+    std::thread consumer([&] {
+        while (true) {
+            notifier.wait([&] {
+                return slot.load(std::memory_order_acquire) ||
+                    done.load(std::memory_order_relaxed);
+            });
+            auto t = slot.load(std::memory_order_acquire);
+            if (!t)
+                return;
+            hist.add(NaCs::getTime() - t);
+            slot.store(0, std::memory_order_release);
+        }
+    });
+    for (int i = 0; i < n; i++) {
+        while (slot.load(std::memory_order_acquire))
+            std::this_thread::yield();
+        if (interval) {
+            auto t0 = NaCs::getTime();
+            while (NaCs::getTime() - t0 < interval) {
+            }
+        }
+        slot.store(NaCs::getTime(), std::memory_order_release);
+        notifier.notify();
+    }
+    while (slot.load(std::memory_order_acquire))
+        std::this_thread::yield();
+    done.store(true, std::memory_order_relaxed);
+    notifier.notify();
+    consumer.join();
+    return hist;
+}
+
+int main()
+{
+    for (uint64_t interval: {0, 50000}) {
+        printf("Interval %llu ns:\n", (unsigned long long)interval);
+        int n = interval ? 20000 : 200000;
+        print_hist("Mutex", run<CondVar>(n, interval));
+        print_hist("Doorbell", run<Bell>(n, interval));
+    }
+    return 0;
+}
@@ -0,0 +1,102 @@
+/*************************************************************************
+ *   Copyright (c) 2018 - 2018 Yichao Yu <yyc1992@gmail.com>             *
+ *                                                                       *
+ *   This library is free software; you can redistribute it and/or       *
+ *   modify it under the terms of the GNU Lesser General Public          *
+ *   License as published by the Free Software Foundation; either        *
+ *   version 3.0 of the License, or (at your option) any later version.  *
+ *                                                                       *
+ *   This library is distributed in the hope that it will be useful,     *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU    *
+ *   Lesser General Public License for more details.                     *
+ *                                                                       *
+ *   You should have received a copy of the GNU Lesser General Public    *
+ *   License along with this library. If not,                            *
+ *   see <http://www.gnu.org/licenses/>.                                 *
+ *************************************************************************/
+
+#include "../lib/config.h"
+#include "../lib/server.h"
+
+#include "alloc_counter.h"
+
+#include <nacs-utils/zmq_utils.h>
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <thread>
+
+using namespace Molecube;
+
+// Count the allocations made by the server for each `run_seq` request.
+// Only the frontend thread is allocation free. The sequence thread still allocates
+// the `PreparedSeq`, the decoded program and the client address for each request
+// (and libzmq allocates the messages with `malloc`, which isn't counted).
+// Those are reported but not checked.
+
+int main()
+{
+    Config conf;
+    conf.dummy = true;
+    conf.listen = "ipc:///tmp/molecube-test-seq-alloc.sock";
+    conf.runtime_dir = "/tmp/molecube-test-seq-alloc/";
+    Server server(conf);
+    std::thread thread([&] {
+        counting_allocs = true;
+        server.run();
+    });
+
+    zmq::context_t ctx;
+    zmq::socket_t sock(ctx, ZMQ_REQ);
+    sock.connect(conf.listen);
+    // Empty sequence (version 3) with one TTL bank.
+    uint32_t ver = 3;
+    uint8_t seq[16] = {};
+    uint32_t nbanks = 1;
+    memcpy(&seq[8], &nbanks, 4);
+    auto run_seq = [&] {
+        zmq::message_t cmd("run_seq", 7);
+        ZMQ::send_more(sock, cmd);
+        zmq::message_t vermsg(&ver, 4);
+        ZMQ::send_more(sock, vermsg);
+        zmq::message_t seqmsg(seq, sizeof(seq));
+        ZMQ::send(sock, seqmsg);
+        zmq::message_t reply;
+#if CPPZMQ_VERSION >= 40301
+        sock.recv(reply);
+#else
+        sock.recv(&reply);
+#endif
+        if (reply.size() < 16) {
+            fprintf(stderr, "run_seq failed\n");
+            exit(1);
+        }
+        // Let the sequence finish so that the server frees everything for it.
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    };
+    // Fill the pools and the containers.
+    for (int i = 0; i < 100; i++)
+        run_seq();
+    int n = 1000;
+    auto c0 = nallocs.load(std::memory_order_relaxed);
+    auto c0_all = nallocs_all.load(std::memory_order_relaxed);
+    for (int i = 0; i < n; i++)
+        run_seq();
+    auto total = nallocs.load(std::memory_order_relaxed) - c0;
+    // The client side of the request doesn't allocate with `operator new`
+    // so these are all from the server threads.
+    auto total_all = nallocs_all.load(std::memory_order_relaxed) - c0_all;
+    printf("run_seq: %.2f allocations per request on the frontend, %.2f on all threads\n",
+           double(total) / n, double(total_all) / n);
+    // Once the pools are filled, the frontend doesn't allocate for the sequences.
+    assert(total == 0);
+
+    server.stop();
+    thread.join();
+    return 0;
+}
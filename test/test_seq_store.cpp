@@ -0,0 +1,99 @@
+/*************************************************************************
+ *   Copyright (c) 2018 - 2018 Yichao Yu <yyc1992@gmail.com>             *
+ *                                                                       *
+ *   This library is free software; you can redistribute it and/or       *
+ *   modify it under the terms of the GNU Lesser General Public          *
+ *   License as published by the Free Software Foundation; either        *
+ *   version 3.0 of the License, or (at your option) any later version.  *
+ *                                                                       *
+ *   This library is distributed in the hope that it will be useful,     *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU    *
+ *   Lesser General Public License for more details.                     *
+ *                                                                       *
+ *   You should have received a copy of the GNU Lesser General Public    *
+ *   License along with this library. If not,                            *
+ *   see <http://www.gnu.org/licenses/>.                                 *
+ *************************************************************************/
+
+#include "../lib/seq_store.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+
+using namespace Molecube;
+
+static zmq::message_t make_msg(char c, size_t sz)
+{
+    zmq::message_t msg(sz);
+    memset(msg.data(), c, sz);
+    return msg;
+}
+
+static SeqStore::Hash add(SeqStore &store, char c, size_t sz,
+                          std::shared_ptr<const SeqStore::Entry> *entry=nullptr)
+{
+    auto msg = make_msg(c, sz);
+    auto hash = SeqStore::hash(3, msg.data(), msg.size());
+    auto res = store.add(hash, 3, msg);
+    assert(res && res->ver == 3 && res->msg.size() == sz);
+    if (entry)
+        *entry = std::move(res);
+    return hash;
+}
+
+static bool has_content(const SeqStore::Entry &entry, char c, size_t sz)
+{
+    auto p = (const char*)entry.msg.data();
+    return entry.msg.size() == sz && std::string(p, sz) == std::string(sz, c);
+}
+
+int main()
+{
+    SeqStore store(100);
+
+    // Add and get.
+    auto ha = add(store, 'a', 40);
+    auto hb = add(store, 'b', 40);
+    assert(ha != hb);
+    assert(store.count() == 2 && store.size() == 80);
+    auto a = store.get(ha);
+    assert(a && has_content(*a, 'a', 40));
+    SeqStore::Hash missing{};
+    assert(!store.get(missing));
+
+    // Adding the same sequence returns the existing entry.
+    std::shared_ptr<const SeqStore::Entry> a2;
+    assert(add(store, 'a', 40, &a2) == ha);
+    assert(a2 == a);
+    assert(store.count() == 2 && store.size() == 80);
+    a.reset();
+    a2.reset();
+
+    // `a` was used more recently so `b` is evicted first.
+    auto hc = add(store, 'c', 40);
+    assert(store.count() == 2 && store.size() == 80);
+    assert(!store.get(hb));
+    assert(store.get(ha) && store.get(hc));
+
+    // An evicted sequence stays alive for as long as it's referenced.
+    std::shared_ptr<const SeqStore::Entry> d;
+    auto hd = add(store, 'd', 30, &d);
+    add(store, 'e', 60);
+    add(store, 'f', 60);
+    assert(!store.get(hd));
+    assert(has_content(*d, 'd', 30));
+    assert(store.size() <= 100);
+
+    // A sequence larger than the limit is still kept if it's the only one.
+    auto hg = add(store, 'g', 200);
+    assert(store.count() == 1 && store.size() == 200);
+    auto g = store.get(hg);
+    assert(g && has_content(*g, 'g', 200));
+
+    printf("Sequence store tests passed.\n");
+    return 0;
+}
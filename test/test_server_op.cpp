@@ -0,0 +1,73 @@
+/*************************************************************************
+ *   Copyright (c) 2018 - 2018 Yichao Yu <yyc1992@gmail.com>             *
+ *                                                                       *
+ *   This library is free software; you can redistribute it and/or       *
+ *   modify it under the terms of the GNU Lesser General Public          *
+ *   License as published by the Free Software Foundation; either        *
+ *   version 3.0 of the License, or (at your option) any later version.  *
+ *                                                                       *
+ *   This library is distributed in the hope that it will be useful,     *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU    *
+ *   Lesser General Public License for more details.                     *
+ *                                                                       *
+ *   You should have received a copy of the GNU Lesser General Public    *
+ *   License along with this library. If not,                            *
+ *   see <http://www.gnu.org/licenses/>.                                 *
+ *************************************************************************/
+
+#include "../lib/server_op.h"
+
+#include <nacs-utils/timer.h>
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+using namespace Molecube;
+using namespace NaCs;
+
+int main()
+{
+    for (int i = 1; i < int(ServerOp::_Num); i++) {
+        auto op = ServerOp(i);
+        auto name = server_op_name(op);
+        assert(name);
+        assert(parse_server_op(name, strlen(name)) == op);
+        uint8_t op8 = uint8_t(i);
+        assert(parse_server_op(&op8, 1) == op);
+        uint16_t op16 = uint16_t(i);
+        assert(parse_server_op(&op16, 2) == op);
+        // Prefixes of the names are not accepted.
+        for (size_t len = 0; len < strlen(name); len++) {
+            assert(parse_server_op(name, len) != op);
+        }
+    }
+    assert(!server_op_name(ServerOp::Invalid));
+    assert(!server_op_name(ServerOp::QueueSeq));
+    uint8_t op8 = 0;
+    assert(parse_server_op(&op8, 1) == ServerOp::Invalid);
+    op8 = uint8_t(ServerOp::QueueSeq);
+    assert(parse_server_op(&op8, 1) == ServerOp::Invalid);
+    uint16_t op16 = 0x100 | uint16_t(ServerOp::RunSeq);
+    assert(parse_server_op(&op16, 2) == ServerOp::Invalid);
+    assert(parse_server_op("queue_seq", 9) == ServerOp::Invalid);
+    assert(parse_server_op("run_seqq", 8) == ServerOp::Invalid);
+    assert(parse_server_op("RUN_SEQ", 7) == ServerOp::Invalid);
+
+    const char *names[] = {"get_startup", "run_seq", "state_id"};
+    for (auto name: names) {
+        auto len = strlen(name);
+        constexpr int n = 1000000;
+        ServerOp res = ServerOp::Invalid;
+        Timer timer;
+        for (int i = 0; i < n; i++) {
+            asm volatile ("" : "+r"(len) :: "memory");
+            res = parse_server_op(name, len);
+        }
+        auto t = timer.elapsed();
+        assert(res != ServerOp::Invalid);
+        printf("%s: %.2f ns\n", name, double(t) / n);
+    }
+    return 0;
+}
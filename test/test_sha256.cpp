@@ -0,0 +1,81 @@
+/*************************************************************************
+ *   Copyright (c) 2018 - 2018 Yichao Yu <yyc1992@gmail.com>             *
+ *                                                                       *
+ *   This library is free software; you can redistribute it and/or       *
+ *   modify it under the terms of the GNU Lesser General Public          *
+ *   License as published by the Free Software Foundation; either        *
+ *   version 3.0 of the License, or (at your option) any later version.  *
+ *                                                                       *
+ *   This library is distributed in the hope that it will be useful,     *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU    *
+ *   Lesser General Public License for more details.                     *
+ *                                                                       *
+ *   You should have received a copy of the GNU Lesser General Public    *
+ *   License along with this library. If not,                            *
+ *   see <http://www.gnu.org/licenses/>.                                 *
+ *************************************************************************/
+
+#include "../lib/sha256.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <string>
+
+using namespace Molecube;
+
+// Known-answer tests from FIPS 180-4 examples.
+
+static std::string to_hex(const SHA256::Digest &digest)
+{
+    std::string res;
+    for (auto b: digest) {
+        char buf[3];
+        snprintf(buf, sizeof(buf), "%02x", b);
+        res += buf;
+    }
+    return res;
+}
+
+static void test_digest(const std::string &msg, const char *expected)
+{
+    auto res = to_hex(SHA256::digest(msg.data(), msg.size()));
+    if (res != expected) {
+        fprintf(stderr, "SHA-256 of %zu bytes: got %s, expected %s\n",
+                msg.size(), res.c_str(), expected);
+        abort();
+    }
+    // Feed the same message in chunks that don't line up with the blocks.
+    for (size_t chunk: {1, 3, 63, 64, 65}) {
+        SHA256 h;
+        for (size_t i = 0; i < msg.size(); i += chunk)
+            h.update(msg.data() + i, std::min(chunk, msg.size() - i));
+        assert(to_hex(h.final()) == res);
+    }
+}
+
+int main()
+{
+    test_digest("", "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+    test_digest("abc", "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+    test_digest("abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+                "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1");
+    test_digest("abcdefghbcdefghicdefghijdefghijkefghijklfghijklmghijklmn"
+                "hijklmnoijklmnopjklmnopqklmnopqrlmnopqrsmnopqrstnopqrstu",
+                "cf5b16a778af8380036ce59e7b0492370b249b11e8f07a51afac45037afee9d1");
+    test_digest(std::string(1000000, 'a'),
+                "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0");
+    // Lengths around the padding boundary.
+    for (size_t len: {55, 56, 63, 64}) {
+        std::string msg(len, 'x');
+        auto d1 = SHA256::digest(msg.data(), len);
+        msg.back() = 'y';
+        auto d2 = SHA256::digest(msg.data(), len);
+        assert(d1 != d2);
+    }
+    printf("SHA-256 tests passed.\n");
+    return 0;
+}
@@ -0,0 +1,116 @@
+/*************************************************************************
+ *   Copyright (c) 2018 - 2018 Yichao Yu <yyc1992@gmail.com>             *
+ *                                                                       *
+ *   This library is free software; you can redistribute it and/or       *
+ *   modify it under the terms of the GNU Lesser General Public          *
+ *   License as published by the Free Software Foundation; either        *
+ *   version 3.0 of the License, or (at your option) any later version.  *
+ *                                                                       *
+ *   This library is distributed in the hope that it will be useful,     *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of      *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU    *
+ *   Lesser General Public License for more details.                     *
+ *                                                                       *
+ *   You should have received a copy of the GNU Lesser General Public    *
+ *   License along with this library. If not,                            *
+ *   see <http://www.gnu.org/licenses/>.                                 *
+ *************************************************************************/
+
+#include "../lib/trace.h"
+
+#include <nacs-utils/timer.h>
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <atomic>
+#include <thread>
+
+using namespace Molecube;
+
+// Check that the events from the `writer` thread in the dump are consecutive
+// and that the `RunSeq` events are converted to a time in `[tmin, tmax]`.
+static void check_dump(const std::vector<uint8_t> &res, uint64_t tmin=0,
+                       uint64_t tmax=UINT64_MAX)
+{
+    size_t pos = 0;
+    auto read_u32 = [&] {
+        uint32_t v;
+        memcpy(&v, &res[pos], 4);
+        pos += 4;
+        return v;
+    };
+    auto read_str = [&] {
+        auto str = (const char*)&res[pos];
+        pos += strlen(str) + 1;
+        return str;
+    };
+    auto nnames = read_u32();
+    assert(nnames == Trace::NEvents);
+    for (uint32_t i = 0; i < nnames; i++)
+        read_str();
+    auto nthreads = read_u32();
+    for (uint32_t i = 0; i < nthreads; i++) {
+        bool is_writer = strcmp(read_str(), "writer") == 0;
+        auto nevents = read_u32();
+        assert(nevents <= Trace::ring_size);
+        uint32_t prev = 0;
+        for (uint32_t j = 0; j < nevents; j++) {
+            uint64_t t;
+            uint32_t info;
+            uint32_t arg;
+            memcpy(&t, &res[pos], 8);
+            memcpy(&info, &res[pos + 8], 4);
+            memcpy(&arg, &res[pos + 12], 4);
+            pos += 16;
+            if ((info & 0xffff) == Trace::RunSeq)
+                assert(t >= tmin && t <= tmax);
+            if (!is_writer)
+                continue;
+            assert(info == (Trace::CmdRun | Trace::Instant << 16));
+            assert(j == 0 || arg > prev);
+            prev = arg;
+        }
+    }
+    assert(pos == res.size());
+}
+
+int main()
+{
+    // Ignored without a ring.
+    Trace::record(Trace::RunSeq, Trace::Instant);
+
+    Trace::init_thread("main");
+    const int n = 10000000;
+    auto t0 = NaCs::getTime();
+    for (int i = 0; i < n; i++)
+        Trace::record(Trace::CmdRun, Trace::Instant, uint32_t(i));
+    printf("Record: %.2f ns/event\n", double(NaCs::getTime() - t0) / n);
+    auto t1 = NaCs::getTime();
+    {
+        Trace::Scope scope(Trace::RunSeq, 1);
+    }
+    auto t2 = NaCs::getTime();
+    t0 = NaCs::getTime();
+    auto res = Trace::dump();
+    printf("Dump: %.2f us\n", double(NaCs::getTime() - t0) / 1000);
+    // Allow for the conversion error and for the resolution of the coarse clock.
+    check_dump(res, t1 - 20000000, t2 + 20000000);
+
+    // Dump while another thread is writing.
+    std::atomic<bool> done{false};
+    std::thread writer([&] {
+        Trace::init_thread("writer");
+        for (uint32_t i = 0; !done.load(std::memory_order_relaxed); i++) {
+            Trace::record(Trace::CmdRun, Trace::Instant, i);
+        }
+    });
+    for (int i = 0; i < 1000; i++)
+        check_dump(Trace::dump());
+    done.store(true, std::memory_order_relaxed);
+    writer.join();
+    printf("Concurrent dump OK\n");
+
+    return 0;
+}